@@ -0,0 +1,255 @@
+#include "protocol.h"
+
+#include <string.h>
+
+namespace protocol {
+
+static const char BASE64_ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static const uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+// ----
+uint32_t readLE(const uint8_t data[], uint8_t length) {
+  uint32_t out = 0;
+  for (uint8_t i = 0; i < length; i++) {
+    out |= (uint32_t)data[i] << (i * 8);
+  }
+
+  return out;
+}
+
+void writeLE(uint8_t output[], uint32_t value, uint8_t length) {
+  for (uint8_t i = 0; i < length; i++) {
+    output[i] = (value >> (i * 8)) & 0xFF;
+  }
+}
+
+// --
+// Standard CRC-32 (zlib.crc32), half a byte at a time to keep the table small
+uint32_t crc32(const uint8_t data[], uint32_t length) {
+  static const uint32_t nibbleTable[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+  };
+
+  uint32_t crc = 0xFFFFFFFF;
+  for (uint32_t i = 0; i < length; i++) {
+    crc = nibbleTable[(crc ^ data[i]) & 0x0F] ^ (crc >> 4);
+    crc = nibbleTable[(crc ^ (data[i] >> 4)) & 0x0F] ^ (crc >> 4);
+  }
+
+  return ~crc;
+}
+
+// --
+static uint64_t rotl64(uint64_t value, uint8_t bits) { return (value << bits) | (value >> (64 - bits)); }
+
+// Byte by byte; sector buffers are not always 8-byte aligned and the ESP8266 faults on unaligned loads
+static uint64_t readLE64(const uint8_t data[]) { return readLE(data, 4) | (uint64_t)readLE(data + 4, 4) << 32; }
+
+static uint64_t xxhRound(uint64_t acc, uint64_t input) {
+  return rotl64(acc + input * XXH_PRIME64_2, 31) * XXH_PRIME64_1;
+}
+
+static uint64_t xxhMergeRound(uint64_t acc, uint64_t lane) {
+  return (acc ^ xxhRound(0, lane)) * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+// The reference algorithm (github.com/Cyan4973/xxHash), one-shot
+uint64_t xxh64(const uint8_t data[], uint32_t length, uint64_t seed) {
+  const uint8_t * pos = data;
+  const uint8_t * end = data + length;
+  uint64_t hash;
+
+  if (length >= 32) {
+    uint64_t lanes[4] = { seed + XXH_PRIME64_1 + XXH_PRIME64_2, seed + XXH_PRIME64_2, seed, seed - XXH_PRIME64_1 };
+
+    for (; end - pos >= 32; pos += 32) {
+      for (uint8_t lane = 0; lane < 4; lane++) { lanes[lane] = xxhRound(lanes[lane], readLE64(pos + lane * 8)); }
+    }
+
+    hash = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) + rotl64(lanes[2], 12) + rotl64(lanes[3], 18);
+    for (uint64_t lane : lanes) { hash = xxhMergeRound(hash, lane); }
+  } else {
+    hash = seed + XXH_PRIME64_5;
+  }
+
+  hash += length;
+
+  for (; end - pos >= 8; pos += 8) {
+    hash = rotl64(hash ^ xxhRound(0, readLE64(pos)), 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+  }
+
+  if (end - pos >= 4) {
+    hash = rotl64(hash ^ (uint64_t)readLE(pos, 4) * XXH_PRIME64_1, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+    pos += 4;
+  }
+
+  for (; pos < end; pos++) {
+    hash = rotl64(hash ^ *pos * XXH_PRIME64_5, 11) * XXH_PRIME64_1;
+  }
+
+  hash ^= hash >> 33;
+  hash *= XXH_PRIME64_2;
+  hash ^= hash >> 29;
+  hash *= XXH_PRIME64_3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+// ----
+size_t base64EncodedLength(size_t length) { return (length + 2) / 3 * 4; }
+
+size_t base64Encode(const uint8_t input[], size_t length, uint8_t output[]) {
+  size_t outLength = 0;
+
+  for (size_t i = 0; i < length; i += 3) {
+    uint32_t group = (uint32_t)input[i] << 16;
+    if (i + 1 < length) { group |= (uint32_t)input[i + 1] << 8; }
+    if (i + 2 < length) { group |= input[i + 2]; }
+
+    output[outLength++] = BASE64_ALPHABET[(group >> 18) & 0x3F];
+    output[outLength++] = BASE64_ALPHABET[(group >> 12) & 0x3F];
+    output[outLength++] = i + 1 < length ? BASE64_ALPHABET[(group >> 6) & 0x3F] : '=';
+    output[outLength++] = i + 2 < length ? BASE64_ALPHABET[group & 0x3F] : '=';
+  }
+
+  return outLength;
+}
+
+// --
+static int8_t base64Value(uint8_t c) {
+  if (c >= 'A' && c <= 'Z') { return c - 'A'; }
+  if (c >= 'a' && c <= 'z') { return c - 'a' + 26; }
+  if (c >= '0' && c <= '9') { return c - '0' + 52; }
+  if (c == '+') { return 62; }
+  if (c == '/') { return 63; }
+  return -1;
+}
+
+// Padding is optional; returns 0 on any character outside the alphabet
+size_t base64Decode(const uint8_t input[], size_t length, uint8_t output[]) {
+  while (length > 0 && input[length - 1] == '=') { length--; }
+
+  size_t outLength = 0;
+  uint32_t bits = 0;
+  uint8_t bitCount = 0;
+  for (size_t i = 0; i < length; i++) {
+    int8_t value = base64Value(input[i]);
+    if (value < 0) { return 0; }
+
+    bits = ((bits << 6) | value) & 0xFFFFFF;
+    bitCount += 6;
+    if (bitCount >= 8) {
+      bitCount -= 8;
+      output[outLength++] = (bits >> bitCount) & 0xFF;
+    }
+  }
+
+  return outLength;
+}
+
+// ----
+// Checks the CRC and the whole extent list before anything is programmed
+frameStatus checkExtentFrame(const uint8_t frame[], uint32_t length, uint32_t flashSize) {
+  if (length < FRAME_COUNT_SIZE + FRAME_CRC_SIZE) { return FRAME_CORRUPT; }
+
+  uint32_t payloadEnd = length - FRAME_CRC_SIZE;
+  if (crc32(frame, payloadEnd) != readLE(frame + payloadEnd, FRAME_CRC_SIZE)) { return FRAME_CORRUPT; }
+
+  uint16_t count = readLE(frame, FRAME_COUNT_SIZE);
+  uint32_t payloadPos = FRAME_COUNT_SIZE + (uint32_t)count * EXTENT_HEADER_SIZE;
+  if (payloadPos > payloadEnd) { return FRAME_BAD_EXTENTS; }
+
+  for (uint16_t i = 0; i < count; i++) {
+    const uint8_t * header = frame + FRAME_COUNT_SIZE + i * EXTENT_HEADER_SIZE;
+    uint32_t offset = readLE(header, 4);
+    uint16_t extentLength = readLE(header + 4, 2);
+
+    if (offset > flashSize || extentLength > flashSize - offset) { return FRAME_BAD_EXTENTS; }
+
+    payloadPos += extentLength;
+    if (payloadPos > payloadEnd) { return FRAME_BAD_EXTENTS; }
+  }
+
+  return payloadPos == payloadEnd ? FRAME_OK : FRAME_BAD_EXTENTS;
+}
+
+size_t extentFrameSize(uint16_t count, uint32_t payloadLength) {
+  return FRAME_COUNT_SIZE + (size_t)count * EXTENT_HEADER_SIZE + payloadLength + FRAME_CRC_SIZE;
+}
+
+// output must hold extentFrameSize() bytes
+size_t packExtentFrame(const Extent extents[], uint16_t count, uint8_t output[]) {
+  writeLE(output, count, FRAME_COUNT_SIZE);
+
+  size_t payloadPos = FRAME_COUNT_SIZE + (size_t)count * EXTENT_HEADER_SIZE;
+  for (uint16_t i = 0; i < count; i++) {
+    uint8_t * header = output + FRAME_COUNT_SIZE + i * EXTENT_HEADER_SIZE;
+    writeLE(header, extents[i].offset, 4);
+    writeLE(header + 4, extents[i].length, 2);
+
+    memcpy(output + payloadPos, extents[i].data, extents[i].length);
+    payloadPos += extents[i].length;
+  }
+
+  writeLE(output + payloadPos, crc32(output, payloadPos), FRAME_CRC_SIZE);
+  return payloadPos + FRAME_CRC_SIZE;
+}
+
+// ----
+ExtentReader::ExtentReader(const uint8_t frame[])
+  : frame(frame), count(readLE(frame, FRAME_COUNT_SIZE)), index(0),
+    payloadPos(FRAME_COUNT_SIZE + (uint32_t)count * EXTENT_HEADER_SIZE) {}
+
+bool ExtentReader::next(Extent & extent) {
+  if (index >= count) { return false; }
+
+  const uint8_t * header = frame + FRAME_COUNT_SIZE + index * EXTENT_HEADER_SIZE;
+  extent.offset = readLE(header, 4);
+  extent.length = readLE(header + 4, 2);
+  extent.data = frame + payloadPos;
+
+  payloadPos += extent.length;
+  index++;
+  return true;
+}
+
+// ----
+int32_t rleDecode(const uint8_t tokens[], uint32_t length, uint8_t output[], uint32_t capacity) {
+  uint32_t outLength = 0;
+  uint32_t pos = 0;
+
+  while (pos < length) {
+    if (length - pos < RLE_TOKEN_HEADER_SIZE) { return -1; }
+
+    uint8_t kind = tokens[pos];
+    uint16_t tokenLength = readLE(tokens + pos + 1, 2);
+    pos += RLE_TOKEN_HEADER_SIZE;
+
+    if (tokenLength > capacity - outLength) { return -1; }
+
+    switch (kind) {
+      case RLE_ERASED_RUN: memset(output + outLength, 0xFF, tokenLength); break;
+      case RLE_ZERO_RUN: memset(output + outLength, 0x00, tokenLength); break;
+
+      case RLE_LITERAL:
+        if (tokenLength > length - pos) { return -1; }
+        memcpy(output + outLength, tokens + pos, tokenLength);
+        pos += tokenLength;
+        break;
+
+      default: return -1;
+    }
+
+    outLength += tokenLength;
+  }
+
+  return outLength;
+}
+
+}  // namespace protocol
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Wire format shared by the firmware and the host (compiled into the _flasher_protocol Python extension)
+// Plain C++ with no Arduino dependencies, so both sides encode and check frames identically
+namespace protocol {
+
+const uint8_t EXTENT_HEADER_SIZE = 6;  // offset:4, length:2
+const uint8_t FRAME_COUNT_SIZE = 2;
+const uint8_t FRAME_CRC_SIZE = 4;
+const uint8_t RLE_TOKEN_HEADER_SIZE = 3;  // kind:1, length:2
+const uint8_t RLE_MIN_RUN = 8;  // Shorter runs cost more as tokens than as literals
+const uint8_t SECTOR_HASH_SIZE = 8;  // xxHash64, little endian
+
+// Dump stream tokens: [kind:1][length:2] followed by length bytes for literals
+enum rleTokens : uint8_t { RLE_ERASED_RUN, RLE_ZERO_RUN, RLE_LITERAL };
+
+enum frameStatus : uint8_t { FRAME_OK, FRAME_CORRUPT, FRAME_BAD_EXTENTS };
+
+struct Extent {
+  uint32_t offset;
+  uint16_t length;
+  const uint8_t * data;
+};
+
+// ----
+uint32_t readLE(const uint8_t data[], uint8_t length);
+void writeLE(uint8_t output[], uint32_t value, uint8_t length);
+
+uint32_t crc32(const uint8_t data[], uint32_t length);
+
+// xxHash64, for sector manifests; fast on the ESP but not collision resistant against deliberate tampering
+uint64_t xxh64(const uint8_t data[], uint32_t length, uint64_t seed = 0);
+
+size_t base64EncodedLength(size_t length);
+size_t base64Encode(const uint8_t input[], size_t length, uint8_t output[]);
+size_t base64Decode(const uint8_t input[], size_t length, uint8_t output[]);
+
+// ----
+// Extent frame: [count:2][count x (offset:4, length:2)][payloads back to back][CRC32 of all before it:4], little endian
+frameStatus checkExtentFrame(const uint8_t frame[], uint32_t length, uint32_t flashSize);
+size_t extentFrameSize(uint16_t count, uint32_t payloadLength);
+size_t packExtentFrame(const Extent extents[], uint16_t count, uint8_t output[]);
+
+// Walks the extents of a frame that passed checkExtentFrame()
+class ExtentReader {
+public:
+  explicit ExtentReader(const uint8_t frame[]);
+  bool next(Extent & extent);
+
+private:
+  const uint8_t * frame;
+  uint16_t count;
+  uint16_t index;
+  uint32_t payloadPos;
+};
+
+// ----
+// Erased (0xFF) and zeroed runs become tokens; everything else is sent as literals
+// sink(const uint8_t data[], uint32_t length) is called with the encoded stream in pieces
+template <typename Sink>
+void rleEncode(const uint8_t data[], uint16_t length, Sink && sink) {
+  auto sendToken = [&](uint8_t kind, uint16_t tokenLength, const uint8_t tokenData[]) {
+    uint8_t header[RLE_TOKEN_HEADER_SIZE] = { kind, (uint8_t)(tokenLength & 0xFF), (uint8_t)(tokenLength >> 8) };
+    sink(header, RLE_TOKEN_HEADER_SIZE);
+
+    if (kind == RLE_LITERAL) { sink(tokenData, tokenLength); }
+  };
+
+  uint16_t literalStart = 0;
+  uint16_t pos = 0;
+  while (pos < length) {
+    uint8_t value = data[pos];
+    uint16_t runEnd = pos + 1;
+
+    if (value == 0xFF || value == 0x00) {
+      while (runEnd < length && data[runEnd] == value) { runEnd++; }
+    }
+
+    if (runEnd - pos >= RLE_MIN_RUN) {
+      if (pos > literalStart) { sendToken(RLE_LITERAL, pos - literalStart, data + literalStart); }
+      sendToken(value == 0xFF ? RLE_ERASED_RUN : RLE_ZERO_RUN, runEnd - pos, nullptr);
+      literalStart = runEnd;
+    }
+
+    pos = runEnd;
+  }
+
+  if (length > literalStart) { sendToken(RLE_LITERAL, length - literalStart, data + literalStart); }
+}
+
+// Returns the decoded length, or -1 if the tokens are malformed or overflow capacity
+int32_t rleDecode(const uint8_t tokens[], uint32_t length, uint8_t output[], uint32_t capacity);
+
+}  // namespace protocol
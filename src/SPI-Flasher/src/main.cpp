@@ -1,35 +1,296 @@
 #include <MD5Builder.h>
 #include <SPIMemory.h>
-#include "base64.hpp"
+#include <LittleFS.h>
+#include <SPI.h>
+#include <protocol.h>
 
 typedef int32_t messagelen_t;  // NOTE: Sign is needed for -1 output by Serial.read()
 const uint16_t DATA_CHUNK_SIZE = 2048;
+const uint16_t SECTOR_SIZE = 4096;
+const uint16_t PAGE_SIZE = 256;  // Unit of a page program command
 const messagelen_t MESSAGE_MAX_SIZE = (int)(DATA_CHUNK_SIZE / .75) + 5;  // n b64 chars <= .75n bytes
 const unsigned long INITIAL_SERIAL_BAUD_RATE = 9600;
+const size_t SERIAL_RX_BUFFER_SIZE = 2 * MESSAGE_MAX_SIZE;  // One frame arriving while the last one is handled
+const uint32_t UART_CLOCK_HZ = 80000000;  // APB clock on both the ESP8266 and ESP32
+const uint32_t MAX_SERIAL_BAUD_RATE = 5000000;  // Beyond this the UART samples too coarsely to be reliable
+const uint8_t MAX_BAUD_ERROR_PERCENT = 3;  // Most USB-UART bridges tolerate ~3% combined mismatch
 
-// ESP -> Host prefixes: ! = Error | @ = MD5 hash to verify | # = Information
+const uint8_t IMAGE_HASH_LENGTH = 32;  // MD5 as hex chars
+const uint8_t MAX_CACHED_IMAGES = 8;
+const uint32_t CACHE_FREE_MARGIN = 16384;  // LittleFS needs some room for metadata
+const char CACHE_DIR[] = "/img/";
+const char CACHE_DIR_PATH[] = "/img";  // CACHE_DIR as LittleFS names the directory itself
+const char CACHE_LRU_PATH[] = "/img/lru";
+
+const uint8_t SECTOR_CACHE_SLOTS = 3;
+const uint16_t MAX_READ_RANGE = DATA_CHUNK_SIZE - 4;  // Room for the CRC32 in dataBuffer
+const uint16_t MAX_HASH_RANGE = (DATA_CHUNK_SIZE - 4) / protocol::SECTOR_HASH_SIZE;  // Sectors per HASH_RANGE reply
+
+// Hardware flow control needs pins of the UART's own; build with -DFLASHER_UART_RTS_PIN=n -DFLASHER_UART_CTS_PIN=n
+#if defined(FLASHER_UART_RTS_PIN) && defined(FLASHER_UART_CTS_PIN)
+#ifndef ESP32
+#error "UART0's RTS and CTS are GPIO15 and GPIO13 on the ESP8266, which drive the flash chip"
+#endif
+const bool HARDWARE_FLOW_CONTROL = true;
+const int8_t UART_RX_PIN = 3;  // UART0's usual pins, passed again as setPins() sets all four
+const int8_t UART_TX_PIN = 1;
+#else
+const bool HARDWARE_FLOW_CONTROL = false;
+#endif
+
+#ifdef ESP32
+const uint8_t TARGET_COUNT = 2;  // One chip on VSPI, one on HSPI
+const uint8_t TARGET_CS_PINS[TARGET_COUNT] = { 5, 15 };
+const uint8_t TARGET_QUEUE_DEPTH = 2;  // Jobs a target may fall behind the link before the loop blocks
+const uint32_t TARGET_TASK_STACK = 4096;
+#else
+const uint8_t TARGET_COUNT = 1;
+const uint8_t TARGET_CS_PINS[TARGET_COUNT] = { SS };
+#endif
+
+// SPI NOR commands the loop sends itself, so it can go on with other work while the chip is busy instead of
+// waiting inside SPIMemory
+const uint32_t FLASH_SPI_CLOCK = 20000000;
+const uint8_t OPCODE_WRITE_ENABLE = 0x06;
+const uint8_t OPCODE_READ_STATUS = 0x05;
+const uint8_t OPCODE_PAGE_PROGRAM = 0x02;
+const uint8_t OPCODE_SECTOR_ERASE = 0x20;
+const uint8_t OPCODE_BLOCK_ERASE_32K = 0x52;
+const uint8_t OPCODE_PAGE_PROGRAM_4B = 0x12;
+const uint8_t OPCODE_SECTOR_ERASE_4B = 0x21;
+const uint8_t OPCODE_BLOCK_ERASE_64K_4B = 0xDC;  // 4 byte chips such as the W25Q256JV have no 4 byte 32K erase
+const uint8_t STATUS_WIP = 0x01;
+const uint8_t STATUS_WEL = 0x02;
+// Larger chips get the 4 byte address opcodes, which don't depend on the address mode SPIMemory left the chip in
+const uint32_t FOUR_BYTE_ADDRESS_SIZE = 0x1000000;
+
+const uint8_t VERIFY_QUEUE_SLOTS = 8;  // Programmed ranges awaiting read-back in VERIFY_OVERLAPPED mode
+const uint16_t VERIFY_STEP_SIZE = 256;  // Read back per loop pass, so the UART is drained in between
+
+const uint16_t B64_PIECE_SIZE = 768;  // Multiple of 3 so pieces concatenate without padding
+
+const char CONTROL_MARKER = '~';
+const uint8_t CONTROL_MAX_SIZE = 8;  // base64 chars between the markers
+const int ERASE_ABORTED = -1;  // Alongside SPIMemory's error codes, which are all positive
+const int WRITE_ENABLE_FAILED = -2;  // The chip didn't latch write enable: write protected or not answering
+
+#ifdef FLASHER_TRACE
+const uint16_t TRACE_RING_SIZE = 256;  // Records; 2KB of RAM
+#define TRACE(event, arg) traceRecord(event, arg)
+#else
+#define TRACE(event, arg)
+#endif
+
+// Protothread-style steps for flash jobs: a step function keeps everything it needs across a yield in its FlashJob,
+// returns STEP_RUNNING where it would otherwise wait, and continues from that line the next time it is called
+#define JOB_BEGIN(job) switch ((job).resumeLine) { case 0:
+#define JOB_YIELD_WHILE(job, condition) do { (job).resumeLine = __LINE__; case __LINE__: if (condition) { return STEP_RUNNING; } } while (0)
+#define JOB_END(job) } (job).resumeLine = 0; return STEP_DONE
+
+// ESP -> Host prefixes: ! = Error | @ = MD5 hash to verify | # = Information | % = Base64 flash data | $ = Clock sample
+//                      ~ = Control reply
 
 // Baud = ! | Erase = @ | Write = # | File Size = $ | Flash Data = % | Do Erase = ^ | Do Flash = & | Reset State = * | Send Flash Info = (
-enum states { NONE, SET_BAUD, SET_ERASE, SET_WRITE, SET_FILE_SIZE, RECV_FLASH_DATA, DO_ERASE, DO_FLASH, RESET_STATE, SEND_FLASH_INFO };
+// Send Sector Hash = ) | Read Sector = [ | Sync Clock = ] | Set Trace = : | Query Cache = ? | Stage Image = ; | Flash From Cache = '
+// Write Extents = { | Patch Extents = } | Flush Sector Cache = . | Dump Trace = " | Dump Range = < | Select Target = | | Read Range = >
+// Set Verify Mode = , | Hash Range = - | Get Stats = _ | Erase Range = `
+enum states { NONE, SET_BAUD, SET_ERASE, SET_WRITE, SET_FILE_SIZE, RECV_FLASH_DATA, DO_ERASE, DO_FLASH, RESET_STATE, SEND_FLASH_INFO,
+              SEND_SECTOR_HASH, READ_SECTOR, SYNC_CLOCK, SET_TRACE, QUERY_CACHE, STAGE_IMAGE, FLASH_FROM_CACHE, WRITE_EXTENTS,
+              PATCH_EXTENTS, FLUSH_SECTOR_CACHE, DUMP_TRACE, DUMP_RANGE, SELECT_TARGET, READ_RANGE, SET_VERIFY_MODE,
+              HASH_RANGE, GET_STATS, ERASE_RANGE };
+
+// How programs are read back; part of the protocol
+// INLINE is SPIMemory's own check, which holds up the ack. OVERLAPPED reads back while the next frame arrives and
+// reports a mismatch in place of the next reply; the host sends FLUSH_SECTOR_CACHE after the last frame to collect it
+enum verifyModes : uint8_t { VERIFY_INLINE, VERIFY_OFF, VERIFY_OVERLAPPED };
+
+// Control frames are ~<base64 command>~ and may arrive anywhere, even in the middle of a command line. They are
+// handled as soon as they are read, including during erases and other long commands, and answered with a '~' line
+enum controlCommands : uint8_t { CONTROL_STATUS, CONTROL_ABORT };
+
+// Trace event IDs are part of the protocol; the host pairs *_START/*_END into spans
+enum traceEvents : uint8_t { TRACE_FRAME_START, TRACE_FRAME_END, TRACE_DECODE_START, TRACE_DECODE_END, TRACE_CHECKSUM_START,
+                             TRACE_CHECKSUM_END, TRACE_PROGRAM_START, TRACE_PROGRAM_END, TRACE_ERASE_START, TRACE_ERASE_END,
+                             TRACE_ACK_SENT };
+
+struct TraceRecord {
+  uint32_t micros;
+  uint16_t arg;
+  uint8_t event;
+  uint8_t reserved;
+};
+
+// Sectors held in RAM so scattered small patches cost one erase per sector
+struct SectorCacheSlot {
+  uint32_t sectorIndex;
+  uint32_t lastUsed;
+  bool valid;
+  bool dirty;
+  byte data[SECTOR_SIZE];
+};
+
+// Every flash chip the ESP can drive; commands act on the selected one
+// On the ESP32 each target has its own SPI bus and a task that programs and erases it, so two chips run in parallel
+enum targetJobKinds : uint8_t { JOB_PROGRAM, JOB_PROGRAM_UNCHECKED, JOB_ERASE_CHIP };
+
+struct TargetJob {
+  uint8_t kind;
+  uint32_t offset;
+  uint16_t length;
+  byte data[DATA_CHUNK_SIZE];
+};
+
+struct FlashTarget {
+  SPIFlash * chip;
+  SPIClass * bus;
+  uint8_t csPin;
+  uint32_t size;
+  volatile uint32_t erasedBytes = 0;  // Progress of the last erase
+  volatile bool abortErase = false;
+#ifdef ESP32
+  QueueHandle_t jobs;
+  TargetJob job;  // The one the task is working on
+  volatile uint32_t jobsQueued = 0;  // Written by the loop only
+  volatile uint32_t jobsDone = 0;  // Written by the target's task only
+  volatile int error = 0;  // First failure since the last reset
+  volatile uint32_t errorOffset = 0;
+#endif
+};
+
+// The erase or program the loop is stepping through, on the selected target; the loop keeps reading frames, answering
+// control frames and handling commands that don't touch the chip until it is done
+// Programs run this way on the ESP8266 only, as the ESP32's target tasks already leave its loop free
+enum flashJobKinds : uint8_t { FLASH_JOB_NONE, FLASH_JOB_ERASE, FLASH_JOB_PROGRAM };
+enum jobSteps : int8_t { STEP_DONE, STEP_RUNNING, STEP_FAILED };
+
+struct FlashJob {
+  uint8_t kind = FLASH_JOB_NONE;
+  uint16_t resumeLine = 0;  // Where the step function yielded; 0 to start over
+  uint32_t offset;
+  uint32_t end;
+  uint32_t address;  // The erase or page program in flight
+  uint32_t stepLength;
+  int error;
+  bool wholeChip;  // Erases answer as DO_ERASE rather than ERASE_RANGE
+  byte data[DATA_CHUNK_SIZE];  // Programs work from a copy, so dataBuffer can take the next frame meanwhile
+};
+
+// Per-job accounting, so the host can tell whether skipping and caching are paying off; cleared by SET_BAUD and resetState()
+struct JobStats {
+  uint32_t bytesReceived = 0;  // Off the link, every frame and control byte included
+  uint32_t bytesProgrammed = 0;
+  uint32_t pagesProgrammed = 0;
+  uint32_t bytesErased = 0;
+  uint32_t sectorsUnchanged = 0;  // Patched sectors that already held their new contents, so were not rewritten
+  uint32_t bytesRejected = 0;  // Extent frames that failed their CRC and were asked for again
+};
+
+// A programmed range still to be read back; its data must stay put until then
+struct PendingVerify {
+  uint32_t offset;
+  const byte * data;
+  uint32_t length;
+};
 states state = NONE;
 
 // ----
 // Function signatures
 void resetState();
+void beginSerial(unsigned long baudRate);
 
-void handleSerialMessage();
+void handleSerialMessage(bool controlOnly);
 void handleData();
+void receiveControlChar(int_least16_t rcvData);
+void handleControlFrame();
+bool pollAbort();
+void abortCommand();
 
 void handleGetFlashInfo();
 void handleSetBaud();
+uint32_t uartActualBaud(uint32_t baudRate);
 void handleSetErase();
 void handleSetWrite();
 void handleSetFileSize();
 void handleDoFlash();
+void handleSendSectorHash();
+void handleReadSector();
+void handleSyncClock();
+void handleSetTrace();
+void handleDumpTrace();
+bool readRangeRequest(unsigned int payloadLength);
+void handleDumpRange();
+void handleReadRange();
+void handleHashRange();
+void handleGetStats();
+void handleQueryCache();
+void handleStageImage();
+void handleFlashFromCache();
+void handleExtentFrame(bool patch);
+void handleFlushSectorCache();
+void handleSelectTarget();
+void handleSetVerifyMode();
 
 void flashChip(uint32_t fileSize, bool doMock);
 void eraseChip();
+void handleEraseRange();
+void startEraseJob(uint32_t offset, uint32_t length, bool wholeChip);
+void startProgramJob(uint32_t offset, const byte data[], uint32_t length);
+int8_t stepEraseJob(FlashJob & job);
+int8_t stepProgramJob(FlashJob & job);
+void runFlashJob();
+void cancelFlashJob();
+bool runsDuringFlashJob(states command);
 void writeData(byte data[], messagelen_t dataLength);
+bool programData(uint32_t offset, byte data[], uint32_t length);
+bool patchData(uint32_t offset, byte data[], uint32_t length);
+bool readSector(uint32_t sectorIndex);
+bool queueVerify(uint32_t offset, const byte data[], uint32_t length);
+bool verifyStep();
+bool finishVerify();
+
+bool readImageHash(char output[]);
+String cachePath(const char * hash);
+uint8_t readCacheLru(char hashes[][IMAGE_HASH_LENGTH + 1]);
+void writeCacheLru(char hashes[][IMAGE_HASH_LENGTH + 1], uint8_t count);
+void touchCachedImage(const char * hash);
+bool evictOldestImage();
+bool evictUnlistedImage(char hashes[][IMAGE_HASH_LENGTH + 1], uint8_t count);
+bool isListedCacheFile(const String & path, char hashes[][IMAGE_HASH_LENGTH + 1], uint8_t count);
+uint32_t cacheTotalBytes();
+uint32_t cacheFreeBytes();
+void stageData(byte data[], uint32_t length);
+void abandonStaging();
+
+SectorCacheSlot * cacheSector(uint32_t sectorIndex);
+void prefetchSector(uint32_t sectorIndex);
+bool writeBackSlot(SectorCacheSlot & slot);
+bool flushSectorCache();
+void invalidateSectorCache();
+
+void beginTarget(uint8_t index, SPIFlash & chip, SPIClass & bus);
+bool selectTarget(uint8_t index);
+void useTarget(uint8_t index);
+void waitForTarget();
+void flashCommand(FlashTarget & target, uint8_t opcode, uint32_t address, const byte data[], uint32_t length);
+uint8_t fourByteOpcode(uint8_t opcode);
+uint8_t flashStatus(FlashTarget & target);
+bool flashWriteEnable(FlashTarget & target);
+bool flashBusy(FlashTarget & target);
+bool programPage(FlashTarget & target, uint32_t address, const byte data[], uint32_t length);
+#ifdef ESP32
+void targetTask(void * param);
+int eraseWholeChip(FlashTarget & target, uint32_t & failedAt);
+void queueTargetJob(FlashTarget & target, uint8_t kind, uint32_t offset, const byte data[], uint16_t length);
+void waitTargetIdle(FlashTarget & target);
+#endif
+
+void sendB64(char prefix, byte data[], uint32_t len);
+void b64StreamBegin(char prefix);
+void b64StreamWrite(const byte data[], uint32_t len);
+void b64StreamFlush();
+void b64StreamEnd();
+void sendSectorRle();
+void traceRecord(uint8_t event, uint16_t arg);
 
 String md5(byte byteArray[], uint32_t len);
 uint32_t byteArrayToInt(byte byteArray[], messagelen_t length);
@@ -40,9 +301,21 @@ uint32_t b64ToInt(byte * toDecode, unsigned int length, byte * buffer);
 // ----
 // Internal objects and variables
 MD5Builder md5Builder;
-SPIFlash flash;
+#ifdef ESP32
+SPIClass hspi(HSPI);
+SPIFlash vspiFlash(TARGET_CS_PINS[0], &SPI);
+SPIFlash hspiFlash(TARGET_CS_PINS[1], &hspi);
+#else
+SPIFlash spiFlash(TARGET_CS_PINS[0]);
+#endif
+
+FlashTarget targets[TARGET_COUNT];
+uint8_t activeTarget = 0;
+bool streamingTargets = false;  // Set by SELECT_TARGET; programs are acknowledged once queued and failures surface at the next flush
+SPIFlash * flash;  // The selected target's chip
 uint32_t flashSize;
 uint32_t currentFlashOffset = 0;
+FlashJob flashJob;
 
 bool shouldDoErase;
 bool shouldDoWrite;
@@ -53,51 +326,165 @@ messagelen_t messageLength = 0;
 messagelen_t currRecvDataPos = 0;
 bool dataNeedsHandling = false;
 
+byte controlMessage[CONTROL_MAX_SIZE];
+uint8_t controlLength = 0;
+bool inControlFrame = false;
+bool abortRequested = false;
+
+JobStats jobStats;
+
+bool traceEnabled = false;
+#ifdef FLASHER_TRACE
+TraceRecord traceRing[TRACE_RING_SIZE];
+uint32_t traceRecordCount = 0;  // Recorded since the last dump; the ring holds the most recent TRACE_RING_SIZE
+#endif
+
 byte dataBuffer[DATA_CHUNK_SIZE];
 uint32_t dataLength = 0;
 
+byte sectorBuffer[SECTOR_SIZE];
+
+uint8_t verifyMode = VERIFY_INLINE;
+PendingVerify pendingVerifies[VERIFY_QUEUE_SLOTS];
+uint8_t pendingVerifyCount = 0;
+uint32_t pendingVerifyPos = 0;  // Progress into the oldest one
+
+byte b64StreamBuffer[B64_PIECE_SIZE];
+uint16_t b64StreamLength = 0;
+
+bool cacheAvailable = false;
+File stageFile;
+MD5Builder stageMd5;
+char stageHash[IMAGE_HASH_LENGTH + 1];
+uint32_t stagedBytes = 0;
+
+SectorCacheSlot sectorCache[SECTOR_CACHE_SLOTS];
+uint32_t sectorCacheClock = 0;
+
 // ------------
 void setup() {
-  Serial.begin(INITIAL_SERIAL_BAUD_RATE);
+  beginSerial(INITIAL_SERIAL_BAUD_RATE);
 
   while (!Serial) { delay(5); }
 
-  flash.begin();
-  flashSize = flash.getCapacity();
+#ifdef ESP32
+  beginTarget(0, vspiFlash, SPI);
+  beginTarget(1, hspiFlash, hspi);
+#else
+  beginTarget(0, spiFlash, SPI);
+#endif
+  useTarget(0);
+
+  cacheAvailable = LittleFS.begin();
+
+  // The ESP32's LittleFS doesn't create parent directories when a file is opened for writing
+  if (cacheAvailable && !LittleFS.exists(CACHE_DIR_PATH)) { cacheAvailable = LittleFS.mkdir(CACHE_DIR_PATH); }
 }
 
 // ----
 void loop() {
-  handleSerialMessage();
+  if (!dataNeedsHandling) { handleSerialMessage(false); }
+
+  // Control frames that came in right behind a command are served before it, and while it waits for a flash job
+  if (dataNeedsHandling) { handleSerialMessage(true); }
+
+  if (abortRequested) {
+    abortCommand();
+    return;
+  }
+
+  // A step per pass; a command that needs the chip waits for the job to finish. Programs get no rest, as a page
+  // program is shorter than delay(1), but erases take long enough for the ESP to need it
+  if (flashJob.kind != FLASH_JOB_NONE) {
+    runFlashJob();
+    if (dataNeedsHandling && runsDuringFlashJob(state)) { handleData(); }
+    if (flashJob.kind == FLASH_JOB_ERASE && Serial.available() == 0) { delay(1); }
+    return;
+  }
 
+  // Read-backs run between UART reads, but must finish before the next command reuses dataBuffer
   if (dataNeedsHandling) {
-    handleData();
+    if (finishVerify()) { handleData(); }
+  } else if (pendingVerifyCount > 0) {
+    verifyStep();
+    return;
   }
 
-  delay(1);  // ESP beauty rest; they REALLY do not like busy loops
+  // ESP beauty rest; they REALLY do not like busy loops. Skipped while pipelined frames are waiting
+  if (Serial.available() == 0) { delay(1); }
 }
 
 void resetState() {
   delay(1000);  // If it takes the host longer than one second to read remaining messages, oh well!
 
   Serial.end();
-  Serial.begin(INITIAL_SERIAL_BAUD_RATE);
+  beginSerial(INITIAL_SERIAL_BAUD_RATE);
+  abandonStaging();
+  invalidateSectorCache();  // Unflushed patches are dropped; the host flushes before it resets
+
+#ifdef ESP32
+  for (FlashTarget & target : targets) {
+    waitTargetIdle(target);
+    target.error = 0;
+  }
+#endif
+  cancelFlashJob();
+  for (FlashTarget & target : targets) { target.abortErase = false; }
+  abortRequested = false;
+  inControlFrame = false;
+  useTarget(0);
+  streamingTargets = false;
+  verifyMode = VERIFY_INLINE;
+  pendingVerifyCount = 0;
+  pendingVerifyPos = 0;
+
   state = NONE;
+  currentFlashOffset = 0;
   shouldDoErase = false;
   shouldDoWrite = false;
   fileSize = 0;
   currRecvDataPos = 0;
   messageLength = 0;
   dataNeedsHandling = false;
+  traceEnabled = false;
+  jobStats = JobStats();
+}
+
+// --
+// The RX buffer is what the host's credit window counts on, so it is set up the same way on every (re)start
+void beginSerial(unsigned long baudRate) {
+  Serial.setRxBufferSize(SERIAL_RX_BUFFER_SIZE);
+  Serial.begin(baudRate);
+
+#if defined(FLASHER_UART_RTS_PIN) && defined(FLASHER_UART_CTS_PIN)
+  Serial.setPins(UART_RX_PIN, UART_TX_PIN, FLASHER_UART_CTS_PIN, FLASHER_UART_RTS_PIN);
+  Serial.setHwFlowCtrlMode();
+#endif
 }
 
 // ----
-void handleSerialMessage() {
+// Stops at the end of each frame; anything after it is the host's next pipelined command and waits in the RX buffer
+// With controlOnly, stops at the first byte that isn't part of a control frame, so it can be called in the middle of a command
+void handleSerialMessage(bool controlOnly) {
   const static char endMarker = '\n';
+  static bool frameStarted = false;
   int_least16_t rcvData;  // Signed to make sure we can read -1
 
   while (Serial.available() > 0) {
+    if (controlOnly && !inControlFrame && Serial.peek() != CONTROL_MARKER) { return; }
+
     rcvData = Serial.read();
+    jobStats.bytesReceived++;
+
+    if (inControlFrame || rcvData == CONTROL_MARKER) {
+      receiveControlChar(rcvData);
+      continue;
+    }
+
+    if (!frameStarted) {
+      TRACE(TRACE_FRAME_START, rcvData);
+      frameStarted = true;
+    }
 
     switch (rcvData) {
       case -1: break;  // Nothing received; this should never happen
@@ -111,12 +498,32 @@ void handleSerialMessage() {
       case '&': state = DO_FLASH; break;
       case '*': state = RESET_STATE; break;
       case '(': state = SEND_FLASH_INFO; break;
+      case ')': state = SEND_SECTOR_HASH; break;
+      case '[': state = READ_SECTOR; break;
+      case ']': state = SYNC_CLOCK; break;
+      case ':': state = SET_TRACE; break;
+      case '"': state = DUMP_TRACE; break;
+      case '<': state = DUMP_RANGE; break;
+      case '>': state = READ_RANGE; break;
+      case '?': state = QUERY_CACHE; break;
+      case ';': state = STAGE_IMAGE; break;
+      case '\'': state = FLASH_FROM_CACHE; break;
+      case '{': state = WRITE_EXTENTS; break;
+      case '}': state = PATCH_EXTENTS; break;
+      case '.': state = FLUSH_SECTOR_CACHE; break;
+      case '|': state = SELECT_TARGET; break;
+      case ',': state = SET_VERIFY_MODE; break;
+      case '-': state = HASH_RANGE; break;
+      case '_': state = GET_STATS; break;
+      case '`': state = ERASE_RANGE; break;
 
       case endMarker:
+        frameStarted = false;
         messageLength = currRecvDataPos;
+        TRACE(TRACE_FRAME_END, messageLength);
         currRecvDataPos = 0;
         dataNeedsHandling = true;
-        break;
+        return;
 
       default:
         receivedMessage[currRecvDataPos] = rcvData;
@@ -130,6 +537,65 @@ void handleSerialMessage() {
   }
 }
 
+// --
+void receiveControlChar(int_least16_t rcvData) {
+  if (!inControlFrame) {
+    inControlFrame = true;
+    controlLength = 0;
+  } else if (rcvData == CONTROL_MARKER) {
+    inControlFrame = false;
+    handleControlFrame();
+  } else if (controlLength < CONTROL_MAX_SIZE) {
+    controlMessage[controlLength++] = rcvData;
+  }
+}
+
+// Never resets by itself; the command being handled may be halfway through the chip
+void handleControlFrame() {
+  byte command[CONTROL_MAX_SIZE];
+  if (b64ToBytes(controlMessage, controlLength, command) != 1) {
+    Serial.println(F("~ERROR: Malformed control frame"));
+    return;
+  }
+
+  switch (command[0]) {
+    case CONTROL_STATUS:
+      Serial.print(F("~STATUS state="));
+      Serial.print((int)state);
+      Serial.print(F(" busy="));
+      Serial.print(dataNeedsHandling || flashJob.kind != FLASH_JOB_NONE ? 1 : 0);
+      Serial.print(F(" offset="));
+      Serial.print(currentFlashOffset);
+      Serial.print(F(" erased="));
+      Serial.print(targets[activeTarget].erasedBytes);
+      Serial.print('/');
+      Serial.println(flashSize);
+      break;
+
+    case CONTROL_ABORT:
+      // Long commands notice at their next poll; the loop catches everything else before the next command
+      abortRequested = true;
+      for (FlashTarget & target : targets) { target.abortErase = true; }
+      Serial.println(F("~ABORTING"));
+      break;
+
+    default:
+      Serial.println(F("~ERROR: Unknown control command"));
+  }
+}
+
+// --
+// For long commands to call between steps, at line boundaries of their output
+bool pollAbort() {
+  handleSerialMessage(true);
+  return abortRequested;
+}
+
+void abortCommand() {
+  Serial.println(F("!ERROR: Aborted"));
+  resetState();
+}
+
 // ----
 void handleData() {
   switch (state) {
@@ -139,7 +605,9 @@ void handleData() {
     case SET_FILE_SIZE: handleSetFileSize(); break;
 
     case RECV_FLASH_DATA:
+      TRACE(TRACE_DECODE_START, messageLength);
       dataLength = b64ToBytes(receivedMessage, messageLength, dataBuffer);
+      TRACE(TRACE_DECODE_END, dataLength);
 
       if (dataLength == 0) {
         Serial.println(F("!ERROR: Data length was 0 after conversion from base64"));
@@ -147,15 +615,38 @@ void handleData() {
         return;
       }
 
+      TRACE(TRACE_CHECKSUM_START, dataLength);
       Serial.println('@' + md5(dataBuffer, dataLength));
+      TRACE(TRACE_CHECKSUM_END, dataLength);
       break;
 
     case DO_ERASE: eraseChip(); break;
+    case ERASE_RANGE: handleEraseRange(); break;
     case DO_FLASH: handleDoFlash(); break;
     
     case RESET_STATE: resetState(); break;
     case SEND_FLASH_INFO: handleGetFlashInfo(); break;
-    
+
+    case SEND_SECTOR_HASH: handleSendSectorHash(); break;
+    case READ_SECTOR: handleReadSector(); break;
+    case SYNC_CLOCK: handleSyncClock(); break;
+    case SET_TRACE: handleSetTrace(); break;
+    case DUMP_TRACE: handleDumpTrace(); break;
+    case DUMP_RANGE: handleDumpRange(); break;
+    case READ_RANGE: handleReadRange(); break;
+    case HASH_RANGE: handleHashRange(); break;
+    case GET_STATS: handleGetStats(); break;
+
+    case QUERY_CACHE: handleQueryCache(); break;
+    case STAGE_IMAGE: handleStageImage(); break;
+    case FLASH_FROM_CACHE: handleFlashFromCache(); break;
+
+    case WRITE_EXTENTS: handleExtentFrame(false); break;
+    case PATCH_EXTENTS: handleExtentFrame(true); break;
+    case FLUSH_SECTOR_CACHE: handleFlushSectorCache(); break;
+    case SELECT_TARGET: handleSelectTarget(); break;
+    case SET_VERIFY_MODE: handleSetVerifyMode(); break;
+
     case NONE: break;
   }
 
@@ -164,7 +655,8 @@ void handleData() {
 }
 
 void handleGetFlashInfo() {
-  uint32_t JEDEC = flash.getJEDECID();
+  waitForTarget();
+  uint32_t JEDEC = flash->getJEDECID();
   if (!JEDEC) {
     Serial.println(F("!ERROR: Connection to flash failed; check wiring."));
 
@@ -173,15 +665,24 @@ void handleGetFlashInfo() {
     Serial.print(F("#Man ID: 0x")); Serial.println(uint8_t(JEDEC >> 16), HEX);
     Serial.print(F("#Memory ID: 0x")); Serial.println(uint8_t(JEDEC >> 8), HEX);
     Serial.print(F("#Capacity: ")); Serial.println(flashSize);
-    Serial.print(F("#Max Pages: ")); Serial.println(flash.getMaxPage());
+    Serial.print(F("#Max Pages: ")); Serial.println(flash->getMaxPage());
+    Serial.print(F("#RX Buffer: ")); Serial.println(SERIAL_RX_BUFFER_SIZE);
+    Serial.print(F("#Flow Control: ")); Serial.println(HARDWARE_FLOW_CONTROL ? F("RTS/CTS") : F("none"));
+    Serial.println(F("#Control: STATUS ABORT"));
+    Serial.println(F("#Sector Hash: xxh64"));
+    Serial.println(F("#Stats: received programmed pages erased unchanged rejected"));
+    Serial.print(F("#Erase Range: ")); Serial.println(SECTOR_SIZE);
+    Serial.println(F("#Info End"));  // Lets the host read however many lines this build sends
   }
 }
 
 // ----
 void handleSetBaud() {
   uint32_t baudRate = b64ToInt(receivedMessage, messageLength, dataBuffer);
+  uint32_t actualRate = baudRate == 0 ? 0 : uartActualBaud(baudRate);
 
-    if (baudRate > 921600) {
+    if (baudRate == 0 || baudRate > MAX_SERIAL_BAUD_RATE
+        || (uint64_t)abs((int64_t)actualRate - baudRate) * 100 > (uint64_t)baudRate * MAX_BAUD_ERROR_PERCENT) {
       Serial.print(F("!ERROR: Invalid baudrate '"));
       Serial.print(baudRate, HEX);
       Serial.println("'");
@@ -190,8 +691,45 @@ void handleSetBaud() {
       return;
     }
 
+    // Sent at the old rate so the host can judge the rate before switching too
+    Serial.print(F("#Baud rate: "));
+    Serial.print(actualRate);
+    Serial.print(F(" actual for "));
+    Serial.print(baudRate);
+    Serial.println(F(" requested"));
+    Serial.flush();
+
     Serial.end();
-    Serial.begin(baudRate);
+    beginSerial(baudRate);
+    jobStats = JobStats();  // Every host session starts here, so this is where a job's accounting starts too
+}
+
+// --
+// The rate the UART's clock divider really produces for a requested rate
+uint32_t uartActualBaud(uint32_t baudRate) {
+#ifdef ESP32
+  // 4 fractional divider bits
+  uint32_t divider = ((uint64_t)UART_CLOCK_HZ << 4) / baudRate;
+  return divider == 0 ? 0 : ((uint64_t)UART_CLOCK_HZ << 4) / divider;
+#else
+  uint32_t divider = UART_CLOCK_HZ / baudRate;
+  return divider == 0 ? 0 : UART_CLOCK_HZ / divider;
+#endif
+}
+
+// Not acknowledged, like the erase and write preferences
+void handleSetVerifyMode() {
+  uint32_t mode = b64ToInt(receivedMessage, messageLength, dataBuffer);
+
+  if (mode > VERIFY_OVERLAPPED) {
+    Serial.print(F("!ERROR: Invalid verify mode "));
+    Serial.println(mode);
+
+    resetState();
+    return;
+  }
+
+  verifyMode = mode;
 }
 
 void handleSetErase() { shouldDoErase = b64ToInt(receivedMessage, messageLength,  dataBuffer); }
@@ -214,55 +752,1256 @@ void handleDoFlash() {
   dataLength = 0;
 }
 
+// Sector hashes let the host skip reading sectors it already has stored
+void handleSendSectorHash() {
+  uint32_t sectorIndex = b64ToInt(receivedMessage, messageLength, dataBuffer);
+  if (!readSector(sectorIndex)) { return; }
+
+  Serial.println('@' + md5(sectorBuffer, SECTOR_SIZE));
+}
+
+void handleReadSector() {
+  uint32_t sectorIndex = b64ToInt(receivedMessage, messageLength, dataBuffer);
+  if (!readSector(sectorIndex)) { return; }
+
+  sendB64('%', sectorBuffer, SECTOR_SIZE);
+}
+
 // ----
-void eraseChip() {
-  Serial.println(F("#Erasing chip..."));
-  Serial.flush();
+// Replies immediately so the host can bound the offset by the round trip time
+void handleSyncClock() {
+  unsigned long now = micros();
 
-  int err;
-  for (int i = 0; i < ceil(flashSize / 32768); i++) {
-    // eraseBlock64K causes soft reset for some reason?
-    flash.eraseBlock32K(32768 * i);
+  Serial.print(F("$clock,"));
+  Serial.print(now);
+  Serial.print(',');
+  Serial.println(now);
+}
 
-    err = flash.error(true);
-    if (err != 0) {
-      Serial.print(F("!ERROR: Flash error during erase in block at "));
-      Serial.print(32768 * i);
-      Serial.print(F(" | Err "));
-      Serial.println(err);
+// Enabling the trace also starts it afresh
+void handleSetTrace() {
+  traceEnabled = b64ToInt(receivedMessage, messageLength, dataBuffer);
+#ifdef FLASHER_TRACE
+  traceRecordCount = 0;
+#endif
+}
+
+// Sent as [recorded since last dump:4][records oldest first], so the host can tell how many were overwritten
+// The ring is emptied afterwards, so the host can dump it periodically without getting duplicates
+void handleDumpTrace() {
+#ifdef FLASHER_TRACE
+  uint16_t heldRecords = min(traceRecordCount, (uint32_t)TRACE_RING_SIZE);
+  uint32_t oldest = traceRecordCount - heldRecords;
+
+  memcpy(sectorBuffer, &traceRecordCount, 4);
+  for (uint16_t i = 0; i < heldRecords; i++) {
+    memcpy(sectorBuffer + 4 + i * sizeof(TraceRecord), &traceRing[(oldest + i) % TRACE_RING_SIZE], sizeof(TraceRecord));
+  }
+
+  sendB64('%', sectorBuffer, 4 + heldRecords * sizeof(TraceRecord));
+  traceRecordCount = 0;
+#else
+  Serial.println(F("!ERROR: Firmware was built without FLASHER_TRACE"));
+#endif
+}
+
+// ----
+// Range requests have fixed size payloads, so any other length is a corrupted or truncated frame
+bool readRangeRequest(unsigned int payloadLength) {
+  if (b64ToBytes(receivedMessage, messageLength, dataBuffer) == payloadLength) { return true; }
+
+  Serial.println(F("!ERROR: Malformed range request"));
+  resetState();
+  return false;
+}
+
+// ----
+// Payload: [first sector:4][sector count:4]
+// Streams one run-length encoded '%' line per sector, then the MD5 of the raw range so the host can check it
+void handleDumpRange() {
+  if (!readRangeRequest(8)) { return; }
+  uint32_t firstSector = byteArrayToInt(dataBuffer, 4);
+  uint32_t sectorCount = byteArrayToInt(dataBuffer + 4, 4);
+
+  if (firstSector > flashSize / SECTOR_SIZE || sectorCount > flashSize / SECTOR_SIZE - firstSector) {
+    Serial.println(F("!ERROR: Dump range exceeds flash size"));
+    resetState();
+    return;
+  }
+
+  md5Builder.begin();
+  for (uint32_t sectorIndex = firstSector; sectorIndex < firstSector + sectorCount; sectorIndex++) {
+    if (!readSector(sectorIndex)) { return; }
+
+    md5Builder.add(sectorBuffer, SECTOR_SIZE);
+    sendSectorRle();
+
+    if (pollAbort()) {
+      abortCommand();
+      return;
+    }
+    yield();
+  }
+  md5Builder.calculate();
+
+  Serial.println('@' + md5Builder.toString());
+}
+
+// ----
+// Payload: [offset:4][length:2]; the reply is the data followed by its CRC32, so the host can just ask again on a bad line
+// Served through the sector cache, so unflushed patches are visible and nearby header probes share one SPI read
+void handleReadRange() {
+  if (!readRangeRequest(6)) { return; }
+  uint32_t offset = byteArrayToInt(dataBuffer, 4);
+  uint32_t length = byteArrayToInt(dataBuffer + 4, 2);
+
+  if (length == 0 || length > MAX_READ_RANGE || offset > flashSize || length > flashSize - offset) {
+    Serial.println(F("!ERROR: Read range is empty, too long or exceeds flash size"));
+    resetState();
+    return;
+  }
+
+  for (uint32_t pos = 0; pos < length;) {
+    SectorCacheSlot * slot = cacheSector((offset + pos) / SECTOR_SIZE);
+    if (slot == nullptr) { return; }
+
+    uint32_t sectorOffset = (offset + pos) % SECTOR_SIZE;
+    uint32_t pieceLength = min(length - pos, SECTOR_SIZE - sectorOffset);
+    memcpy(dataBuffer + pos, slot->data + sectorOffset, pieceLength);
+    pos += pieceLength;
+  }
+
+  protocol::writeLE(dataBuffer + length, protocol::crc32(dataBuffer, length), 4);
+  sendB64('%', dataBuffer, length + 4);
+
+  // Read ahead while the reply is still going out; probes tend to walk forward through headers
+  uint32_t nextSector = (offset + length - 1) / SECTOR_SIZE + 1;
+  if (nextSector < flashSize / SECTOR_SIZE) { prefetchSector(nextSector); }
+}
+
+// ----
+// Payload: [first sector:4][sector count:2]; the reply is each sector's xxHash64 followed by the CRC32 of them all
+// xxHash64 keeps up with SPI reads where MD5 doesn't, so hashing a whole chip for a manifest costs little more than reading it
+void handleHashRange() {
+  if (!readRangeRequest(6)) { return; }
+  uint32_t firstSector = byteArrayToInt(dataBuffer, 4);
+  uint32_t sectorCount = byteArrayToInt(dataBuffer + 4, 2);
+
+  if (sectorCount == 0 || sectorCount > MAX_HASH_RANGE || firstSector > flashSize / SECTOR_SIZE
+      || sectorCount > flashSize / SECTOR_SIZE - firstSector) {
+    Serial.println(F("!ERROR: Hash range is empty, too long or exceeds flash size"));
+    resetState();
+    return;
+  }
+
+  for (uint32_t i = 0; i < sectorCount; i++) {
+    if (!readSector(firstSector + i)) { return; }
+
+    uint64_t hash = protocol::xxh64(sectorBuffer, SECTOR_SIZE);
+    protocol::writeLE(dataBuffer + i * protocol::SECTOR_HASH_SIZE, (uint32_t)hash, 4);
+    protocol::writeLE(dataBuffer + i * protocol::SECTOR_HASH_SIZE + 4, (uint32_t)(hash >> 32), 4);
+
+    if (pollAbort()) {
+      abortCommand();
+      return;
+    }
+    yield();
+  }
+
+  uint32_t hashesLength = sectorCount * protocol::SECTOR_HASH_SIZE;
+  protocol::writeLE(dataBuffer + hashesLength, protocol::crc32(dataBuffer, hashesLength), 4);
+  sendB64('%', dataBuffer, hashesLength + 4);
+}
+
+// --
+void handleGetStats() {
+  Serial.print(F("#STATS received=")); Serial.print(jobStats.bytesReceived);
+  Serial.print(F(" programmed=")); Serial.print(jobStats.bytesProgrammed);
+  Serial.print(F(" pages=")); Serial.print(jobStats.pagesProgrammed);
+  Serial.print(F(" erased=")); Serial.print(jobStats.bytesErased);
+  Serial.print(F(" unchanged=")); Serial.print(jobStats.sectorsUnchanged);
+  Serial.print(F(" rejected=")); Serial.println(jobStats.bytesRejected);
+}
+
+// ----
+// Images are cached on the ESP's own flash, named by their MD5, so repeat jobs need no transfer
+void handleQueryCache() {
+  char hash[IMAGE_HASH_LENGTH + 1];
+  if (!readImageHash(hash)) { return; }
+
+  if (cacheAvailable && LittleFS.exists(cachePath(hash))) {
+    Serial.println(F("#CACHE_HIT"));
+  } else {
+    Serial.println(F("#CACHE_MISS"));
+  }
+}
+
+void handleStageImage() {
+  abandonStaging();
+  if (!readImageHash(stageHash)) { return; }
+
+  // An image that can never fit mustn't evict the ones that do on its way to being skipped
+  bool canStage = cacheAvailable && fileSize > 0 && fileSize + CACHE_FREE_MARGIN <= cacheTotalBytes();
+  while (canStage && cacheFreeBytes() < fileSize + CACHE_FREE_MARGIN) {
+    canStage = evictOldestImage();
+  }
+
+  if (canStage) {
+    stageFile = LittleFS.open(cachePath(stageHash) + ".part", "w");
+    canStage = (bool)stageFile;
+  }
+
+  if (!canStage) {
+    Serial.println(F("#CACHE_SKIP"));
+    return;
+  }
 
+  stagedBytes = 0;
+  stageMd5.begin();
+  Serial.println(F("#STAGING"));
+}
+
+void handleFlashFromCache() {
+  char hash[IMAGE_HASH_LENGTH + 1];
+  if (!readImageHash(hash)) { return; }
+
+  File image;
+  if (cacheAvailable) { image = LittleFS.open(cachePath(hash), "r"); }
+
+  if (!image || image.size() > flashSize) {
+    Serial.println(F("!ERROR: Image is not in the cache"));
+    resetState();
+    return;
+  }
+
+  touchCachedImage(hash);
+  invalidateSectorCache();
+
+  uint32_t imageSize = image.size();
+  for (currentFlashOffset = 0; currentFlashOffset < imageSize; currentFlashOffset += dataLength) {
+    if (!finishVerify()) {
+      image.close();
+      return;
+    }
+
+    dataLength = image.read(dataBuffer, DATA_CHUNK_SIZE);
+
+    if (dataLength == 0) {
+      Serial.println(F("!ERROR: Could not read cached image"));
+      image.close();
       resetState();
       return;
     }
 
-    delay(1);  // ESP beauty rest
+    if (!programData(currentFlashOffset, dataBuffer, dataLength)) {
+      image.close();
+      return;
+    }
+
+    if (pollAbort()) {
+      image.close();
+      abortCommand();
+      return;
+    }
+    yield();
   }
 
-  Serial.println(F("#Chip erased"));
+  image.close();
+  dataLength = 0;
+  if (!finishVerify()) { return; }
+
+  Serial.println(F("#Cache flash done"));
 }
 
 // ----
-void writeData(byte data[], messagelen_t dataLength) {
-  flash.writeByteArray(currentFlashOffset, data, dataLength);
-  int flashErrNo = flash.error(true);
+// Frame layout is in protocol.h; self-checking, so each frame is written in one round trip and X_BAD asks the host to resend it
+// Patch frames go through the sector cache instead, so they may land on sectors that were not erased
+void handleExtentFrame(bool patch) {
+  TRACE(TRACE_DECODE_START, messageLength);
+  dataLength = b64ToBytes(receivedMessage, messageLength, dataBuffer);
+  TRACE(TRACE_DECODE_END, dataLength);
 
-  if (flashErrNo != 0) {
-    Serial.print(F("!ERROR: Flash error during write in page at "));
-    Serial.print(currentFlashOffset);
+  TRACE(TRACE_CHECKSUM_START, dataLength);
+  protocol::frameStatus status = protocol::checkExtentFrame(dataBuffer, dataLength, flashSize);
+  TRACE(TRACE_CHECKSUM_END, dataLength);
+
+  if (status == protocol::FRAME_CORRUPT) {
+    jobStats.bytesRejected += messageLength;
+    Serial.println(F("#X_BAD"));
+    dataLength = 0;
+    return;
+  }
+
+  if (status != protocol::FRAME_OK) {
+    Serial.println(F("!ERROR: Extent list does not match its payload or exceeds flash size"));
+    resetState();
+    return;
+  }
+
+  if (!patch) { invalidateSectorCache(); }
+
+  protocol::ExtentReader reader(dataBuffer);
+  protocol::Extent extent;
+  uint32_t bytesWritten = 0;
+  while (reader.next(extent)) {
+    byte * data = const_cast<byte *>(extent.data);
+    if (!(patch ? patchData(extent.offset, data, extent.length) : programData(extent.offset, data, extent.length))) { return; }
+    bytesWritten += extent.length;
+  }
+
+  dataLength = 0;
+  Serial.println(F("#X_OK"));
+  TRACE(TRACE_ACK_SENT, bytesWritten);
+}
+
+// Also waits for the selected target's queued programs and erases, so P_FLUSHED means everything sent so far is on the chip
+void handleFlushSectorCache() {
+  if (!flushSectorCache()) { return; }
+
+#ifdef ESP32
+  FlashTarget & target = targets[activeTarget];
+  waitTargetIdle(target);
+
+  if (target.error != 0) {
+    Serial.print(F("!ERROR: Flash error on target "));
+    Serial.print(activeTarget);
+    Serial.print(F(" at "));
+    Serial.print(target.errorOffset);
     Serial.print(F(" : Err "));
-    Serial.println(flashErrNo);
+    Serial.println(target.error);
 
     resetState();
     return;
-  
-  } else {
-    Serial.println(F("#W_OK"));
-    Serial.flush();
-    currentFlashOffset += dataLength;
   }
+#endif
+
+  Serial.println(F("#P_FLUSHED"));
+}
+
+// --
+void handleSelectTarget() {
+  uint32_t index = b64ToInt(receivedMessage, messageLength, dataBuffer);
+
+  if (index >= TARGET_COUNT || targets[index].size == 0) {
+    Serial.print(F("!ERROR: No flash chip on target "));
+    Serial.println(index);
+
+    resetState();
+    return;
+  }
+
+  if (!selectTarget(index)) { return; }
+
+  streamingTargets = true;
+  Serial.println(F("#T_OK"));
+}
+
+// ----
+void eraseChip() {
+  Serial.println(F("#Erasing chip..."));
+  Serial.flush();
+
+  invalidateSectorCache();
+
+  TRACE(TRACE_ERASE_START, 0);
+#ifdef ESP32
+  if (streamingTargets) {
+    queueTargetJob(targets[activeTarget], JOB_ERASE_CHIP, 0, nullptr, 0);
+    jobStats.bytesErased += flashSize;
+    return;  // Erase the other target meanwhile; FLUSH_SECTOR_CACHE waits for it
+  }
+#endif
+
+  // Answered with 'Chip erased' once the job is done
+  waitForTarget();
+  startEraseJob(0, flashSize, true);
+}
+
+// --
+// Payload: [offset:4][length:4][CRC32 of both:4], offset and length multiples of SECTOR_SIZE
+// Aligned blocks are erased whole and the rest sector by sector, so a large range costs about its share of a chip erase
+void handleEraseRange() {
+  if (!readRangeRequest(12)) { return; }
+
+  // A corrupted frame would otherwise erase whatever range its bytes happen to decode to
+  if (protocol::crc32(dataBuffer, 8) != byteArrayToInt(dataBuffer + 8, 4)) {
+    Serial.println(F("!ERROR: Erase range failed its CRC"));
+    resetState();
+    return;
+  }
+
+  uint32_t offset = byteArrayToInt(dataBuffer, 4);
+  uint32_t length = byteArrayToInt(dataBuffer + 4, 4);
+
+  if (length == 0 || offset % SECTOR_SIZE != 0 || length % SECTOR_SIZE != 0 || offset > flashSize || length > flashSize - offset) {
+    Serial.println(F("!ERROR: Erase range is empty, not sector aligned or exceeds flash size"));
+    resetState();
+    return;
+  }
+
+  // Nothing may be left to program or read back in the range
+  if (!finishVerify()) { return; }
+  invalidateSectorCache();
+  waitForTarget();
+
+  // Answered with 'E_DONE' once the job is done
+  TRACE(TRACE_ERASE_START, offset / SECTOR_SIZE);
+  startEraseJob(offset, length, false);
+}
+
+// ----
+void startEraseJob(uint32_t offset, uint32_t length, bool wholeChip) {
+  flashJob.kind = FLASH_JOB_ERASE;
+  flashJob.resumeLine = 0;
+  flashJob.offset = offset;
+  flashJob.end = offset + length;
+  flashJob.wholeChip = wholeChip;
+  targets[activeTarget].erasedBytes = 0;
+}
+
+void startProgramJob(uint32_t offset, const byte data[], uint32_t length) {
+  flashJob.kind = FLASH_JOB_PROGRAM;
+  flashJob.resumeLine = 0;
+  flashJob.offset = offset;
+  flashJob.end = offset + length;
+  memcpy(flashJob.data, data, length);
+}
+
+// --
+// Aligned blocks are erased whole and the rest sector by sector: 32K blocks, or 64K on chips with 4 byte addresses
+int8_t stepEraseJob(FlashJob & job) {
+  FlashTarget & target = targets[activeTarget];
+  bool fourByteAddress = target.size > FOUR_BYTE_ADDRESS_SIZE;
+  uint32_t blockSize = fourByteAddress ? 65536 : 32768;
+  uint8_t blockEraseOpcode = fourByteAddress ? OPCODE_BLOCK_ERASE_64K_4B : OPCODE_BLOCK_ERASE_32K;
+
+  JOB_BEGIN(job);
+  for (job.address = job.offset; job.address < job.end; job.address += job.stepLength) {
+    job.stepLength = job.address % blockSize == 0 && job.end - job.address >= blockSize ? blockSize : SECTOR_SIZE;
+    if (!flashWriteEnable(target)) {
+      job.error = WRITE_ENABLE_FAILED;
+      return STEP_FAILED;
+    }
+
+    flashCommand(target, job.stepLength == SECTOR_SIZE ? OPCODE_SECTOR_ERASE : blockEraseOpcode, job.address, nullptr, 0);
+    JOB_YIELD_WHILE(job, flashBusy(target));
+
+    jobStats.bytesErased += job.stepLength;
+    target.erasedBytes = job.address + job.stepLength - job.offset;
+  }
+  JOB_END(job);
+}
+
+// --
+// A page program wraps around at the end of its page, so each one stops there
+int8_t stepProgramJob(FlashJob & job) {
+  FlashTarget & target = targets[activeTarget];
+
+  JOB_BEGIN(job);
+  for (job.address = job.offset; job.address < job.end; job.address += job.stepLength) {
+    job.stepLength = min(job.end - job.address, (uint32_t)(PAGE_SIZE - job.address % PAGE_SIZE));
+    if (!flashWriteEnable(target)) {
+      job.error = WRITE_ENABLE_FAILED;
+      return STEP_FAILED;
+    }
+
+    flashCommand(target, OPCODE_PAGE_PROGRAM, job.address, job.data + (job.address - job.offset), job.stepLength);
+    JOB_YIELD_WHILE(job, flashBusy(target));
+  }
+  JOB_END(job);
+}
+
+// --
+// Advances the job by a step and answers its command once it is done
+void runFlashJob() {
+  int8_t step = flashJob.kind == FLASH_JOB_ERASE ? stepEraseJob(flashJob) : stepProgramJob(flashJob);
+  if (step == STEP_RUNNING) { return; }
+
+  uint8_t kind = flashJob.kind;
+  flashJob.kind = FLASH_JOB_NONE;
+
+  if (step == STEP_FAILED) {
+    bool erasing = kind == FLASH_JOB_ERASE;
+    Serial.print(erasing ? F("!ERROR: Flash error during erase in block at ") : F("!ERROR: Flash error during write in page at "));
+    Serial.print(flashJob.address);
+    Serial.print(erasing ? F(" | Err ") : F(" : Err "));
+    Serial.println(flashJob.error);
+
+    resetState();
+    return;
+  }
+
+  if (kind == FLASH_JOB_ERASE) {
+    TRACE(TRACE_ERASE_END, flashJob.offset / SECTOR_SIZE);
+    Serial.println(flashJob.wholeChip ? F("#Chip erased") : F("#E_DONE"));
+    return;
+  }
+
+  uint32_t length = flashJob.end - flashJob.offset;
+  TRACE(TRACE_PROGRAM_END, length);
+
+  // Read-backs come from the job's copy of the data; the loop finishes them before the next command can replace it
+  if (verifyMode != VERIFY_OFF && !queueVerify(flashJob.offset, flashJob.data, length)) { return; }
+  if (verifyMode == VERIFY_INLINE) {
+    if (!finishVerify()) { return; }
+
+    Serial.println(F("#W_OK"));
+    TRACE(TRACE_ACK_SENT, length);
+  }
+}
+
+// An erase or page program the chip has started runs to its end regardless, so resetting waits for that
+void cancelFlashJob() {
+  if (flashJob.kind == FLASH_JOB_NONE) { return; }
+
+  while (flashBusy(targets[activeTarget])) { delay(1); }
+  flashJob.kind = FLASH_JOB_NONE;
+}
+
+// Commands that neither touch the chip nor change anything a flash job depends on
+bool runsDuringFlashJob(states command) {
+  return command == RECV_FLASH_DATA || command == SYNC_CLOCK || command == GET_STATS || command == DUMP_TRACE;
+}
+
+// ----
+void writeData(byte data[], messagelen_t dataLength) {
+  invalidateSectorCache();
+
+#ifdef ESP32
+  if (!programData(currentFlashOffset, data, dataLength)) { return; }
+#else
+  // With VERIFY_INLINE the job acknowledges once it has read the data back; otherwise the next frame is received and
+  // hashed while this one programs, and a failure is reported in place of a later reply
+  TRACE(TRACE_PROGRAM_START, dataLength);
+  jobStats.bytesProgrammed += dataLength;
+  if (dataLength > 0) { jobStats.pagesProgrammed += (currentFlashOffset + dataLength - 1) / PAGE_SIZE - currentFlashOffset / PAGE_SIZE + 1; }
+  startProgramJob(currentFlashOffset, data, dataLength);
+#endif
+
+  stageData(data, dataLength);
+  currentFlashOffset += dataLength;
+
+#ifndef ESP32
+  if (verifyMode == VERIFY_INLINE) { return; }
+#endif
+  Serial.println(F("#W_OK"));
+  Serial.flush();
+  TRACE(TRACE_ACK_SENT, dataLength);
+}
+
+// --
+bool programData(uint32_t offset, byte data[], uint32_t length) {
+  TRACE(TRACE_PROGRAM_START, length);
+  jobStats.bytesProgrammed += length;
+  if (length > 0) { jobStats.pagesProgrammed += (offset + length - 1) / PAGE_SIZE - offset / PAGE_SIZE + 1; }
+
+#ifdef ESP32
+  // The target's task reads back on its own core time, so overlapped checks just don't wait for it
+  FlashTarget & target = targets[activeTarget];
+  uint8_t kind = verifyMode == VERIFY_OFF ? JOB_PROGRAM_UNCHECKED : JOB_PROGRAM;
+  for (uint32_t pos = 0; pos < length; pos += DATA_CHUNK_SIZE) {
+    queueTargetJob(target, kind, offset + pos, data + pos, min(length - pos, (uint32_t)DATA_CHUNK_SIZE));
+  }
+  if (!streamingTargets && verifyMode != VERIFY_OVERLAPPED) { waitTargetIdle(target); }
+
+  int flashErrNo = target.error;  // May be from an earlier streamed job
+  if (flashErrNo != 0) { offset = target.errorOffset; }
+#else
+  // Unchecked, this returns once the last page is sent; the chip's next command waits out WIP
+  flash->writeByteArray(offset, data, length, verifyMode == VERIFY_INLINE);
+  int flashErrNo = flash->error(true);
+  if (flashErrNo == 0 && verifyMode == VERIFY_OVERLAPPED && !queueVerify(offset, data, length)) { return false; }
+#endif
+  TRACE(TRACE_PROGRAM_END, length);
+
+  if (flashErrNo != 0) {
+    Serial.print(F("!ERROR: Flash error during write in page at "));
+    Serial.print(offset);
+    Serial.print(F(" : Err "));
+    Serial.println(flashErrNo);
+
+    resetState();
+    return false;
+  }
+
+  return true;
+}
+
+// --
+bool patchData(uint32_t offset, byte data[], uint32_t length) {
+  while (length > 0) {
+    SectorCacheSlot * slot = cacheSector(offset / SECTOR_SIZE);
+    if (slot == nullptr) { return false; }
+
+    uint32_t sectorOffset = offset % SECTOR_SIZE;
+    uint32_t pieceLength = min(length, SECTOR_SIZE - sectorOffset);
+
+    memcpy(slot->data + sectorOffset, data, pieceLength);
+    slot->dirty = true;
+
+    offset += pieceLength;
+    data += pieceLength;
+    length -= pieceLength;
+  }
+
+  return true;
+}
+
+// --
+bool readSector(uint32_t sectorIndex) {
+  if (sectorIndex >= flashSize / SECTOR_SIZE) {
+    Serial.print(F("!ERROR: Sector index out of range: "));
+    Serial.println(sectorIndex);
+
+    resetState();
+    return false;
+  }
+
+  waitForTarget();
+  flash->readByteArray(sectorIndex * SECTOR_SIZE, sectorBuffer, SECTOR_SIZE);
+  int flashErrNo = flash->error(true);
+
+  if (flashErrNo != 0) {
+    Serial.print(F("!ERROR: Flash error during read in sector "));
+    Serial.print(sectorIndex);
+    Serial.print(F(" : Err "));
+    Serial.println(flashErrNo);
+
+    resetState();
+    return false;
+  }
+
+  return true;
+}
+
+// ----
+// Only used on the ESP8266; on the ESP32 the target tasks read back themselves
+bool queueVerify(uint32_t offset, const byte data[], uint32_t length) {
+  if (pendingVerifyCount == VERIFY_QUEUE_SLOTS && !finishVerify()) { return false; }
+
+  pendingVerifies[pendingVerifyCount++] = { offset, data, length };
+  return true;
+}
+
+// --
+// Reads back up to VERIFY_STEP_SIZE bytes of the oldest pending range
+bool verifyStep() {
+  static byte readBack[VERIFY_STEP_SIZE];
+  PendingVerify & pending = pendingVerifies[0];
+
+  uint32_t stepLength = min(pending.length - pendingVerifyPos, (uint32_t)VERIFY_STEP_SIZE);
+  flash->readByteArray(pending.offset + pendingVerifyPos, readBack, stepLength);
+  int flashErrNo = flash->error(true);
+
+  if (flashErrNo != 0 || memcmp(readBack, pending.data + pendingVerifyPos, stepLength) != 0) {
+    Serial.print(F("!ERROR: Verify failed in page at "));
+    Serial.print(pending.offset + pendingVerifyPos);
+    Serial.print(F(" : Err "));
+    Serial.println(flashErrNo);
+
+    resetState();
+    return false;
+  }
+
+  pendingVerifyPos += stepLength;
+  if (pendingVerifyPos == pending.length) {
+    memmove(pendingVerifies, pendingVerifies + 1, (pendingVerifyCount - 1) * sizeof(PendingVerify));
+    pendingVerifyCount--;
+    pendingVerifyPos = 0;
+  }
+
+  return true;
+}
+
+bool finishVerify() {
+  while (pendingVerifyCount > 0) {
+    if (!verifyStep()) { return false; }
+  }
+
+  return true;
+}
+
+// ----
+bool readImageHash(char output[]) {
+  unsigned int hashLength = b64ToBytes(receivedMessage, messageLength, dataBuffer);
+
+  bool isValid = hashLength == IMAGE_HASH_LENGTH;
+  for (unsigned int i = 0; isValid && i < hashLength; i++) {
+    isValid = isxdigit(dataBuffer[i]);
+  }
+
+  if (!isValid) {
+    Serial.println(F("!ERROR: Invalid image hash"));
+    resetState();
+    return false;
+  }
+
+  memcpy(output, dataBuffer, IMAGE_HASH_LENGTH);
+  output[IMAGE_HASH_LENGTH] = '\0';
+  return true;
+}
+
+// --
+String cachePath(const char * hash) { return String(CACHE_DIR) + hash; }
+
+// --
+// The LRU list is one hash per line, least recently used first
+uint8_t readCacheLru(char hashes[][IMAGE_HASH_LENGTH + 1]) {
+  File lruFile = LittleFS.open(CACHE_LRU_PATH, "r");
+  if (!lruFile) { return 0; }
+
+  uint8_t count = 0;
+  while (count < MAX_CACHED_IMAGES && lruFile.read((uint8_t *)hashes[count], IMAGE_HASH_LENGTH + 1) == IMAGE_HASH_LENGTH + 1) {
+    hashes[count][IMAGE_HASH_LENGTH] = '\0';
+    count++;
+  }
+
+  lruFile.close();
+  return count;
+}
+
+void writeCacheLru(char hashes[][IMAGE_HASH_LENGTH + 1], uint8_t count) {
+  File lruFile = LittleFS.open(CACHE_LRU_PATH, "w");
+  if (!lruFile) { return; }
+
+  for (uint8_t i = 0; i < count; i++) {
+    lruFile.write((uint8_t *)hashes[i], IMAGE_HASH_LENGTH);
+    lruFile.write('\n');
+  }
+
+  lruFile.close();
+}
+
+// --
+void touchCachedImage(const char * hash) {
+  char hashes[MAX_CACHED_IMAGES + 1][IMAGE_HASH_LENGTH + 1];
+  uint8_t count = readCacheLru(hashes);
+
+  uint8_t kept = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    if (strcmp(hashes[i], hash) != 0) { memcpy(hashes[kept++], hashes[i], IMAGE_HASH_LENGTH + 1); }
+  }
+  memcpy(hashes[kept++], hash, IMAGE_HASH_LENGTH + 1);
+
+  // Past the image limit, the oldest entry is dropped along with its file
+  if (kept > MAX_CACHED_IMAGES) {
+    LittleFS.remove(cachePath(hashes[0]));
+    writeCacheLru(hashes + 1, kept - 1);
+  } else {
+    writeCacheLru(hashes, kept);
+  }
+}
+
+bool evictOldestImage() {
+  char hashes[MAX_CACHED_IMAGES][IMAGE_HASH_LENGTH + 1];
+  uint8_t count = readCacheLru(hashes);
+  if (evictUnlistedImage(hashes, count)) { return true; }
+  if (count == 0) { return false; }
+
+  LittleFS.remove(cachePath(hashes[0]));
+  writeCacheLru(hashes + 1, count - 1);
+  return true;
+}
+
+// --
+// Files the LRU doesn't list go first, as nothing else would ever remove them: an image whose LRU write failed after
+// the rename, or a staging file left by a reset
+bool evictUnlistedImage(char hashes[][IMAGE_HASH_LENGTH + 1], uint8_t count) {
+  String victim;
+
+#ifdef ESP32
+  File dir = LittleFS.open(CACHE_DIR);
+  if (!dir) { return false; }
+
+  for (File entry = dir.openNextFile(); entry && victim.length() == 0; entry = dir.openNextFile()) {
+    if (!isListedCacheFile(entry.name(), hashes, count)) { victim = entry.name(); }
+  }
+#else
+  Dir dir = LittleFS.openDir(CACHE_DIR);
+  while (victim.length() == 0 && dir.next()) {
+    if (!isListedCacheFile(dir.fileName(), hashes, count)) { victim = dir.fileName(); }
+  }
+#endif
+
+  if (victim.length() == 0) { return false; }
+  return LittleFS.remove(String(CACHE_DIR) + victim.substring(victim.lastIndexOf('/') + 1));
+}
+
+// Directory listings give a bare name or a full path depending on the core, so only the part after the last '/' counts
+bool isListedCacheFile(const String & path, char hashes[][IMAGE_HASH_LENGTH + 1], uint8_t count) {
+  String name = path.substring(path.lastIndexOf('/') + 1);
+  if (name == CACHE_LRU_PATH + strlen(CACHE_DIR)) { return true; }
+
+  for (uint8_t i = 0; i < count; i++) {
+    if (name == hashes[i]) { return true; }
+  }
+
+  return false;
+}
+
+// --
+uint32_t cacheTotalBytes() {
+#ifdef ESP32
+  return LittleFS.totalBytes();
+#else
+  FSInfo info;
+  if (!LittleFS.info(info)) { return 0; }
+  return info.totalBytes;
+#endif
+}
+
+uint32_t cacheFreeBytes() {
+#ifdef ESP32
+  return LittleFS.totalBytes() - LittleFS.usedBytes();
+#else
+  FSInfo info;
+  if (!LittleFS.info(info)) { return 0; }
+  return info.totalBytes - info.usedBytes;
+#endif
+}
+
+// --
+// Copies each written chunk into the cache; the image is only kept if its MD5 matches at the end
+void stageData(byte data[], uint32_t length) {
+  if (!stageFile) { return; }
+
+  if (stageFile.write(data, length) != length) {
+    abandonStaging();
+    return;
+  }
+
+  stageMd5.add(data, length);
+  stagedBytes += length;
+  if (stagedBytes < fileSize) { return; }
+
+  stageFile.close();
+  stageMd5.calculate();
+
+  if (stageMd5.toString().equalsIgnoreCase(stageHash)) {
+    LittleFS.remove(cachePath(stageHash));
+    LittleFS.rename(cachePath(stageHash) + ".part", cachePath(stageHash));
+    touchCachedImage(stageHash);
+    Serial.println(F("#Image cached"));
+  } else {
+    LittleFS.remove(cachePath(stageHash) + ".part");
+  }
+}
+
+void abandonStaging() {
+  if (!stageFile) { return; }
+
+  stageFile.close();
+  LittleFS.remove(cachePath(stageHash) + ".part");
+}
+
+// ----
+// Returns the slot holding the sector, loading it over the least recently used slot if needed
+SectorCacheSlot * cacheSector(uint32_t sectorIndex) {
+  SectorCacheSlot * victim = nullptr;
+
+  for (SectorCacheSlot & slot : sectorCache) {
+    if (slot.valid && slot.sectorIndex == sectorIndex) {
+      slot.lastUsed = ++sectorCacheClock;
+      return &slot;
+    }
+
+    if (victim == nullptr || (victim->valid && (!slot.valid || slot.lastUsed < victim->lastUsed))) { victim = &slot; }
+  }
+
+  if (!writeBackSlot(*victim)) { return nullptr; }
+
+  waitForTarget();
+  flash->readByteArray(sectorIndex * SECTOR_SIZE, victim->data, SECTOR_SIZE);
+  int flashErrNo = flash->error(true);
+
+  if (flashErrNo != 0) {
+    Serial.print(F("!ERROR: Flash error during read in sector "));
+    Serial.print(sectorIndex);
+    Serial.print(F(" : Err "));
+    Serial.println(flashErrNo);
+
+    resetState();
+    return nullptr;
+  }
+
+  victim->sectorIndex = sectorIndex;
+  victim->valid = true;
+  victim->dirty = false;
+  victim->lastUsed = ++sectorCacheClock;
+  return victim;
+}
+
+// --
+// Only takes a clean slot, so reading ahead never causes a write-back
+void prefetchSector(uint32_t sectorIndex) {
+  SectorCacheSlot * victim = nullptr;
+
+  for (SectorCacheSlot & slot : sectorCache) {
+    if (slot.valid && slot.sectorIndex == sectorIndex) { return; }
+    if (slot.dirty) { continue; }
+
+    if (victim == nullptr || (victim->valid && (!slot.valid || slot.lastUsed < victim->lastUsed))) { victim = &slot; }
+  }
+
+  if (victim == nullptr) { return; }
+
+  waitForTarget();
+  flash->readByteArray(sectorIndex * SECTOR_SIZE, victim->data, SECTOR_SIZE);
+
+  victim->sectorIndex = sectorIndex;
+  victim->valid = flash->error(true) == 0;  // A failed read-ahead is just a miss later
+  victim->dirty = false;
+  victim->lastUsed = ++sectorCacheClock;
+}
+
+// --
+// Erases only if some bit has to go from 0 back to 1; otherwise only the bytes that changed are programmed over the
+// old data. SPIMemory's writeByteArray() refuses to program anything but erased bytes, so this uses raw page programs
+bool writeBackSlot(SectorCacheSlot & slot) {
+  if (!slot.valid || !slot.dirty) { return true; }
+
+  FlashTarget & target = targets[activeTarget];
+  uint32_t address = slot.sectorIndex * SECTOR_SIZE;
+
+  waitForTarget();
+  flash->readByteArray(address, sectorBuffer, SECTOR_SIZE);
+  int flashErrNo = flash->error(true);
+
+  if (flashErrNo != 0) {
+    Serial.print(F("!ERROR: Flash error during read in sector "));
+    Serial.print(slot.sectorIndex);
+    Serial.print(F(" : Err "));
+    Serial.println(flashErrNo);
+
+    resetState();
+    return false;
+  }
+
+  // Patches that put back what the sector already held cost nothing
+  if (memcmp(sectorBuffer, slot.data, SECTOR_SIZE) == 0) {
+    jobStats.sectorsUnchanged++;
+    slot.dirty = false;
+    return true;
+  }
+
+  bool needsErase = false;
+  for (uint32_t i = 0; i < SECTOR_SIZE && !needsErase; i++) {
+    needsErase = (sectorBuffer[i] & slot.data[i]) != slot.data[i];
+  }
+
+  if (needsErase) {
+    jobStats.bytesErased += SECTOR_SIZE;
+    TRACE(TRACE_ERASE_START, slot.sectorIndex);
+    flash->eraseSector(address);
+    flashErrNo = flash->error(true);
+    TRACE(TRACE_ERASE_END, slot.sectorIndex);
+
+    if (flashErrNo != 0) {
+      Serial.print(F("!ERROR: Flash error during erase in sector "));
+      Serial.print(slot.sectorIndex);
+      Serial.print(F(" : Err "));
+      Serial.println(flashErrNo);
+
+      resetState();
+      return false;
+    }
+
+    memset(sectorBuffer, 0xFF, SECTOR_SIZE);
+  }
+
+  // One program per page, from its first changed byte to its last
+  TRACE(TRACE_PROGRAM_START, SECTOR_SIZE);
+  for (uint32_t page = 0; page < SECTOR_SIZE; page += PAGE_SIZE) {
+    uint32_t first = page;
+    uint32_t last = page + PAGE_SIZE;
+    while (first < last && sectorBuffer[first] == slot.data[first]) { first++; }
+    while (last > first && sectorBuffer[last - 1] == slot.data[last - 1]) { last--; }
+    if (first == last) { continue; }
+
+    jobStats.bytesProgrammed += last - first;
+    jobStats.pagesProgrammed++;
+    if (!programPage(target, address + first, slot.data + first, last - first)) {
+      Serial.print(F("!ERROR: Flash error during write in page at "));
+      Serial.print(address + first);
+      Serial.print(F(" : Err "));
+      Serial.println(WRITE_ENABLE_FAILED);
+
+      resetState();
+      return false;
+    }
+  }
+  TRACE(TRACE_PROGRAM_END, SECTOR_SIZE);
+
+  // The slot may be refilled straight after, so even an overlapped read-back can't wait
+  if (verifyMode != VERIFY_OFF) {
+    flash->readByteArray(address, sectorBuffer, SECTOR_SIZE);
+    flashErrNo = flash->error(true);
+
+    if (flashErrNo != 0 || memcmp(sectorBuffer, slot.data, SECTOR_SIZE) != 0) {
+      Serial.print(F("!ERROR: Verify failed in sector "));
+      Serial.print(slot.sectorIndex);
+      Serial.print(F(" : Err "));
+      Serial.println(flashErrNo);
+
+      resetState();
+      return false;
+    }
+  }
+
+  slot.dirty = false;
+  return true;
+}
+
+// --
+bool flushSectorCache() {
+  for (SectorCacheSlot & slot : sectorCache) {
+    if (!writeBackSlot(slot)) { return false; }
+  }
+
+  return true;
+}
+
+// --
+// Called before anything writes the chip directly, so cached sectors never go stale
+void invalidateSectorCache() {
+  for (SectorCacheSlot & slot : sectorCache) {
+    slot.valid = false;
+    slot.dirty = false;
+  }
+}
+
+// ----
+void beginTarget(uint8_t index, SPIFlash & chip, SPIClass & bus) {
+  FlashTarget & target = targets[index];
+  target.chip = &chip;
+  target.bus = &bus;
+  target.csPin = TARGET_CS_PINS[index];
+  target.size = chip.begin() ? chip.getCapacity() : 0;
+
+#ifdef ESP32
+  target.jobs = xQueueCreate(TARGET_QUEUE_DEPTH, sizeof(TargetJob));
+  xTaskCreate(targetTask, "flash target", TARGET_TASK_STACK, &target, 1, nullptr);
+#endif
+}
+
+// --
+// Cached sectors and staging belong to one chip, so they are settled before switching
+bool selectTarget(uint8_t index) {
+  if (index == activeTarget) { return true; }
+  if (!flushSectorCache()) { return false; }
+
+  invalidateSectorCache();
+  abandonStaging();
+  currentFlashOffset = 0;
+  useTarget(index);
+  return true;
+}
+
+void useTarget(uint8_t index) {
+  activeTarget = index;
+  flash = targets[index].chip;
+  flashSize = targets[index].size;
+}
+
+// --
+// Before the loop touches the selected chip directly
+void waitForTarget() {
+#ifdef ESP32
+  waitTargetIdle(targets[activeTarget]);
+#endif
+}
+
+// --
+// Every opcode but write enable is followed by an address
+void flashCommand(FlashTarget & target, uint8_t opcode, uint32_t address, const byte data[], uint32_t length) {
+  bool fourByteAddress = opcode != OPCODE_WRITE_ENABLE && target.size > FOUR_BYTE_ADDRESS_SIZE;
+
+  target.bus->beginTransaction(SPISettings(FLASH_SPI_CLOCK, MSBFIRST, SPI_MODE0));
+  digitalWrite(target.csPin, LOW);
+
+  target.bus->transfer(fourByteAddress ? fourByteOpcode(opcode) : opcode);
+  if (opcode != OPCODE_WRITE_ENABLE) {
+    if (fourByteAddress) { target.bus->transfer(address >> 24); }
+    target.bus->transfer(address >> 16);
+    target.bus->transfer(address >> 8);
+    target.bus->transfer(address);
+  }
+  if (length > 0) { target.bus->writeBytes(data, length); }
+
+  digitalWrite(target.csPin, HIGH);
+  target.bus->endTransaction();
+}
+
+uint8_t fourByteOpcode(uint8_t opcode) {
+  switch (opcode) {
+    case OPCODE_PAGE_PROGRAM: return OPCODE_PAGE_PROGRAM_4B;
+    case OPCODE_SECTOR_ERASE: return OPCODE_SECTOR_ERASE_4B;
+    default: return opcode;
+  }
+}
+
+uint8_t flashStatus(FlashTarget & target) {
+  target.bus->beginTransaction(SPISettings(FLASH_SPI_CLOCK, MSBFIRST, SPI_MODE0));
+  digitalWrite(target.csPin, LOW);
+  target.bus->transfer(OPCODE_READ_STATUS);
+  uint8_t status = target.bus->transfer(0);
+  digitalWrite(target.csPin, HIGH);
+  target.bus->endTransaction();
+
+  return status;
+}
+
+bool flashWriteEnable(FlashTarget & target) {
+  flashCommand(target, OPCODE_WRITE_ENABLE, 0, nullptr, 0);
+  return flashStatus(target) & STATUS_WEL;
+}
+
+bool flashBusy(FlashTarget & target) { return flashStatus(target) & STATUS_WIP; }
+
+// A page program wraps around at the end of its page, so data must not cross one
+bool programPage(FlashTarget & target, uint32_t address, const byte data[], uint32_t length) {
+  if (!flashWriteEnable(target)) { return false; }
+
+  flashCommand(target, OPCODE_PAGE_PROGRAM, address, data, length);
+  while (flashBusy(target)) { yield(); }
+  return true;
+}
+
+#ifdef ESP32
+// --
+void targetTask(void * param) {
+  FlashTarget & target = *(FlashTarget *)param;
+
+  while (true) {
+    xQueueReceive(target.jobs, &target.job, portMAX_DELAY);
+
+    uint32_t failedAt = target.job.offset;
+    int err;
+    if (target.job.kind == JOB_ERASE_CHIP) {
+      err = eraseWholeChip(target, failedAt);
+    } else {
+      target.chip->writeByteArray(target.job.offset, target.job.data, target.job.length, target.job.kind == JOB_PROGRAM);
+      err = target.chip->error(true);
+    }
+
+    if (err != 0 && target.error == 0) {
+      target.errorOffset = failedAt;
+      target.error = err;
+    }
+
+    target.jobsDone = target.jobsDone + 1;
+  }
+}
+
+// --
+// Blocks while the target is TARGET_QUEUE_DEPTH jobs behind
+void queueTargetJob(FlashTarget & target, uint8_t kind, uint32_t offset, const byte data[], uint16_t length) {
+  static TargetJob job;  // Too big for the loop task's stack
+
+  job.kind = kind;
+  job.offset = offset;
+  job.length = length;
+  if (length > 0) { memcpy(job.data, data, length); }
+
+  target.jobsQueued = target.jobsQueued + 1;
+  xQueueSend(target.jobs, &job, portMAX_DELAY);
+}
+
+// Serves control frames meanwhile, so an erase can be watched and aborted
+void waitTargetIdle(FlashTarget & target) {
+  while (target.jobsDone != target.jobsQueued) {
+    handleSerialMessage(true);
+    delay(1);
+  }
+}
+
+// --
+// Returns the flash error code, with the failing block in failedAt; progress is kept in the target for STATUS
+int eraseWholeChip(FlashTarget & target, uint32_t & failedAt) {
+  target.erasedBytes = 0;
+
+  for (uint32_t address = 0; address < target.size; address += 32768) {
+    if (target.abortErase) {
+      failedAt = address;
+      return ERASE_ABORTED;
+    }
+
+    // eraseBlock64K causes soft reset for some reason?
+    target.chip->eraseBlock32K(address);
+
+    int err = target.chip->error(true);
+    if (err != 0) {
+      failedAt = address;
+      return err;
+    }
+
+    target.erasedBytes = address + 32768;
+    delay(1);  // ESP beauty rest
+  }
+
+  return 0;
+}
+#endif
+
+// ----
+void sendB64(char prefix, byte data[], uint32_t len) {
+  b64StreamBegin(prefix);
+  b64StreamWrite(data, len);
+  b64StreamEnd();
+}
+
+// --
+// Encodes in pieces so the whole base64 line never has to sit in RAM at once
+void b64StreamBegin(char prefix) {
+  b64StreamLength = 0;
+  Serial.print(prefix);
+}
+
+void b64StreamWrite(const byte data[], uint32_t len) {
+  while (len > 0) {
+    uint16_t pieceLength = min(len, (uint32_t)(B64_PIECE_SIZE - b64StreamLength));
+    memcpy(b64StreamBuffer + b64StreamLength, data, pieceLength);
+
+    b64StreamLength += pieceLength;
+    data += pieceLength;
+    len -= pieceLength;
+
+    if (b64StreamLength == B64_PIECE_SIZE) { b64StreamFlush(); }
+  }
+}
+
+void b64StreamFlush() {
+  static unsigned char encoded[(B64_PIECE_SIZE / 3) * 4];
+
+  unsigned int encodedLength = protocol::base64Encode(b64StreamBuffer, b64StreamLength, encoded);
+  Serial.write(encoded, encodedLength);
+  b64StreamLength = 0;
+}
+
+void b64StreamEnd() {
+  if (b64StreamLength > 0) { b64StreamFlush(); }
+  Serial.println();
+}
+
+// --
+void sendSectorRle() {
+  b64StreamBegin('%');
+  protocol::rleEncode(sectorBuffer, SECTOR_SIZE, b64StreamWrite);
+  b64StreamEnd();
+}
+
+// --
+#ifdef FLASHER_TRACE
+void traceRecord(uint8_t event, uint16_t arg) {
+  if (!traceEnabled) { return; }
 
-  return;
+  TraceRecord & record = traceRing[traceRecordCount % TRACE_RING_SIZE];
+  record.micros = micros();
+  record.arg = arg;
+  record.event = event;
+  traceRecordCount++;
 }
+#endif
 
 // ----
 String md5(byte byteArray[], uint32_t len) {
@@ -303,11 +2042,11 @@ void byteArrayToHex(byte byteArray[], unsigned int length, char output[]) {
 
 // --
 unsigned int b64ToBytes(unsigned char * toDecode, unsigned int length, byte * output) {
-  return decode_base64(toDecode, length, output);
+  return protocol::base64Decode(toDecode, length, output);
 }
 
 // --
 uint32_t b64ToInt(unsigned char * toDecode, unsigned int length, byte buffer[]) {
-  unsigned int outLength = decode_base64(toDecode, length, buffer);
+  unsigned int outLength = protocol::base64Decode(toDecode, length, buffer);
   return byteArrayToInt(buffer, outLength);
 }
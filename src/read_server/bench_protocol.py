@@ -0,0 +1,166 @@
+import argparse
+import contextlib
+import hashlib
+import io
+import itertools
+import random
+import time
+
+import spi_flasher
+from chunk_pipeline import worker_count
+from protocol_codec import NATIVE
+from spi_flasher import DATA_CHUNK_SIZE, encode_command, handle_serial_message, write_command
+
+
+DEFAULT_CHUNKS = 2000
+DEFAULT_REPEATS = 5
+BITS_PER_BYTE = 10  # 8N1: start bit, 8 data bits, stop bit
+
+# ------------
+class LoopbackConnection:
+    """
+    Stands in for the serial connection: writes are counted and dropped, and readline()
+    hands out canned replies, so only the host's own work is timed
+    """
+
+    def __init__(self, replies=()):
+        self.replies = iter(replies)
+        self.timeout = 5
+        self.bytes_written = 0
+
+    def write(self, data):
+        self.bytes_written += len(data)
+        return len(data)
+
+    def readline(self):
+        return next(self.replies, b'')
+
+# ----
+def time_per_item(run, item_count, repeats):
+    """
+    Runs run() repeats times and returns the best time per item in seconds
+    The best run is the one least disturbed by the rest of the machine
+    """
+
+    best = float('inf')
+    for _ in range(repeats):
+        start_time = time.perf_counter()
+        run()
+        best = min(best, time.perf_counter() - start_time)
+
+    return best / item_count
+
+# ------------
+def component_cases(chunks):
+    """
+    Each step the host takes per chunk, on its own: (name, run over every chunk)
+    """
+
+    replies = [b'@' + hashlib.md5(chunk).hexdigest().encode('ascii') + b'\r\n' for chunk in chunks]
+
+    def encode():
+        for chunk in chunks:
+            encode_command('SEND_FLASH_DATA', chunk)
+
+    def write():
+        connection = LoopbackConnection()
+        for chunk in chunks:
+            write_command(connection, 'SEND_FLASH_DATA', chunk)
+
+    def md5():
+        for chunk in chunks:
+            hashlib.md5(chunk).hexdigest()
+
+    def read_reply():
+        connection = LoopbackConnection(replies)
+        for _ in chunks:
+            handle_serial_message(connection, mute_info=True, mandatory=True)
+
+    def prepare():
+        for offset, chunk in enumerate(chunks):
+            spi_flasher.prepare_chunk((offset * DATA_CHUNK_SIZE, chunk))
+
+    return [
+        ('encode_command (base64 frame)', encode),
+        ('write_command (frame + write)', write),
+        ('md5 hexdigest', md5),
+        ('handle_serial_message (hash)', read_reply),
+        ('prepare_chunk (md5 + frame)', prepare)
+    ]
+
+def path_cases(image, chunks):
+    """
+    Whole write paths through the real host code, prep pool included: (name, run, chunks per run)
+    """
+
+    chunk_replies = [[b'@' + hashlib.md5(chunk).hexdigest().encode('ascii') + b'\r\n', b'#W_OK\r\n'] for chunk in chunks]
+    extents = spi_flasher.plan_extents(image)
+    frame_count = sum(1 for _ in spi_flasher.pack_extent_frames(spi_flasher.extent_pieces(image, extents)))
+
+    def chunked():
+        with contextlib.redirect_stdout(io.StringIO()):
+            spi_flasher.write_image(LoopbackConnection(itertools.chain.from_iterable(chunk_replies)), image)
+
+    def extent_frames():
+        pieces = spi_flasher.extent_pieces(image, extents)
+        spi_flasher.send_extent_frames(LoopbackConnection(itertools.repeat(b'#X_OK\r\n')), 'WRITE_EXTENTS', pieces,
+                                       sum(length for _, length in extents), show_progress=False)
+
+    return [
+        ('write_image (hash + W_OK per chunk)', chunked, len(chunks)),
+        ('send_extent_frames (X_OK per frame)', extent_frames, frame_count)
+    ]
+
+# ----
+def report_row(name, seconds, link_chunks_per_second):
+    """
+    Prints µs per chunk, the chunk rate the host could sustain on that work alone, and that rate against the link's
+    Below 1.0x the host, not the link, limits throughput
+    """
+
+    chunks_per_second = 1 / seconds
+    print(f'{name:38} {seconds * 1e6:9.1f} {chunks_per_second:10.0f} {chunks_per_second * DATA_CHUNK_SIZE / 1e6:8.1f} '
+          f'{chunks_per_second / link_chunks_per_second:7.1f}x')
+
+# ----
+def main():
+    """
+    Handle arguments and run the benchmarks
+    """
+
+    parser = argparse.ArgumentParser(description='Time the host\'s per-chunk protocol work against an in-memory loopback')
+
+    parser.add_argument('-chunks', nargs='?', type=int, default=DEFAULT_CHUNKS, help=f'Chunks per run (default: {DEFAULT_CHUNKS})')
+    parser.add_argument('-repeat', nargs='?', type=int, default=DEFAULT_REPEATS, help=f'Runs per benchmark; the best is reported (default: {DEFAULT_REPEATS})')
+    parser.add_argument('-baud', nargs='?', type=int, default=921600, help='Link rate to compare against (default: 921600)')
+    parser.add_argument('-prep-workers', nargs='?', type=worker_count, default=spi_flasher.DEFAULT_WORKERS, help='Chunk preparation workers for the write paths (default: one per CPU)')
+
+    args = parser.parse_args()
+
+    spi_flasher.PREP_WORKERS = args.prep_workers
+
+    # Random data, so nothing is skipped as blank
+    image = random.Random(0).randbytes(args.chunks * DATA_CHUNK_SIZE)
+    chunks = [image[pos: pos + DATA_CHUNK_SIZE] for pos in range(0, len(image), DATA_CHUNK_SIZE)]
+
+    frame_length = len(encode_command('SEND_FLASH_DATA', chunks[0]))
+    link_chunks_per_second = args.baud / BITS_PER_BYTE / frame_length
+
+    print(f'{len(chunks)} chunks of {DATA_CHUNK_SIZE} bytes, best of {args.repeat}; '
+          f'{"native" if NATIVE else "pure-Python"} protocol codec')
+    print(f'The link at {args.baud} baud carries {link_chunks_per_second:.0f} chunks/s ({frame_length} byte frames)\n')
+    print(f'{"":38} {"us/chunk":>9} {"chunks/s":>10} {"MB/s":>8} {"vs link":>8}')
+
+    for name, run in component_cases(chunks):
+        report_row(name, time_per_item(run, len(chunks), args.repeat), link_chunks_per_second)
+
+    print()
+    for name, run, item_count in path_cases(image, chunks):
+        report_row(name, time_per_item(run, item_count, args.repeat), link_chunks_per_second)
+
+# ----
+if __name__ == '__main__':
+    try:
+        main()
+    except KeyboardInterrupt:
+        print('Exiting...')
@@ -0,0 +1,57 @@
+import argparse
+import collections
+import concurrent.futures
+import os
+
+
+DEFAULT_WORKERS = os.cpu_count() or 1
+CHUNKS_AHEAD_PER_WORKER = 4
+
+# ------------
+def prepare_in_order(prepare, items, workers=DEFAULT_WORKERS, use_processes=False):
+    """
+    Yields prepare(item) for every item, in order, while a pool works ahead
+
+    At most workers * CHUNKS_AHEAD_PER_WORKER results are in flight, so memory
+    stays bounded however large the image is. prepare must be a module-level
+    function when use_processes is set, so it can be pickled.
+    """
+
+    depth = max(1, workers * CHUNKS_AHEAD_PER_WORKER)
+    executor_class = concurrent.futures.ProcessPoolExecutor if use_processes else concurrent.futures.ThreadPoolExecutor
+
+    items = iter(items)
+    pending = collections.deque()
+
+    with executor_class(max_workers=workers) as executor:
+        try:
+            for item in items:
+                pending.append(executor.submit(prepare, item))
+                if len(pending) >= depth:
+                    break
+
+            while pending:
+                result = pending.popleft().result()
+
+                for item in items:
+                    pending.append(executor.submit(prepare, item))
+                    break
+
+                yield result
+
+        finally:
+            # Abandoned early (error or interrupt); don't finish work nobody will use
+            for future in pending:
+                future.cancel()
+
+# ----
+def worker_count(value):
+    """
+    argparse type for worker counts; a pool needs at least one
+    """
+
+    workers = int(value)
+    if workers < 1:
+        raise argparse.ArgumentTypeError(f'needs at least one worker, got {workers}')
+
+    return workers
@@ -0,0 +1,799 @@
+import argparse
+import base64
+import collections
+import hashlib
+import mmap
+import os
+import select
+import struct
+import tempfile
+import threading
+import time
+import tty
+
+from protocol_codec import crc32, rle_encode, xxh64
+
+
+DATA_CHUNK_SIZE = 2048
+SECTOR_SIZE = 4096
+PAGE_SIZE = 256
+MAX_CACHED_IMAGES = 8
+SECTOR_CACHE_SLOTS = 3
+MAX_READ_RANGE = DATA_CHUNK_SIZE - 4
+MAX_HASH_RANGE = (DATA_CHUNK_SIZE - 4) // 8
+SERIAL_RX_BUFFER_SIZE = 2 * (int(DATA_CHUNK_SIZE / .75) + 5)  # The firmware's, as reported; the pty holds far more
+TRACE_RING_SIZE = 256
+UART_CLOCK_HZ = 80000000
+MAX_SERIAL_BAUD_RATE = 5000000
+TRACE_EVENTS = ['FRAME_START', 'FRAME_END', 'DECODE_START', 'DECODE_END', 'CHECKSUM_START',
+                'CHECKSUM_END', 'PROGRAM_START', 'PROGRAM_END', 'ERASE_START', 'ERASE_END',
+                'ACK_SENT']
+DEFAULT_JEDEC_ID = 0xEF4018  # Winbond W25Q128
+VERIFY_INLINE, VERIFY_OFF, VERIFY_OVERLAPPED = range(3)
+PREVWRITTEN = 0x07  # SPIMemory's code for a write over bytes that aren't erased
+ERRORCHKFAIL = 0x0A  # SPIMemory's code for a failed write check
+STATE_CHARS = '!@#$%^&*()[]:?;\'{}."<|>,-_`'  # The firmware's states enum after NONE, as STATUS reports it
+CONTROL_MARKER = ord('~')
+CONTROL_STATUS, CONTROL_ABORT = range(2)
+JOB_STATS = ['received', 'programmed', 'pages', 'erased', 'unchanged', 'rejected']  # GET_STATS fields, in order
+
+# Flash contents are stored bit-inverted so erased bytes (0xFF) are zeros on disk.
+# That keeps blank chips and mostly-erased snapshots as sparse files.
+INVERT = bytes(0xFF - i for i in range(256))
+SPARSE_PAGE = mmap.PAGESIZE
+
+# ------------
+class VerifyFailed(Exception):
+    """
+    Raised by an inline-checked program that didn't read back as written
+    """
+
+    def __init__(self, offset):
+        super().__init__(offset)
+        self.offset = offset
+
+class PreviouslyWritten(Exception):
+    """
+    Raised by a program through SPIMemory over bytes that aren't erased, which it refuses
+    """
+
+    def __init__(self, offset):
+        super().__init__(offset)
+        self.offset = offset
+
+# ------------
+class FlashModel:
+    """
+    NOR flash backed by a copy-on-write mapping of a snapshot file
+
+    restore() maps a snapshot privately, so it is instant at any chip size and
+    only the pages written afterwards take up memory. snapshot() saves the current
+    contents as a new sparse snapshot file.
+    """
+
+    def __init__(self, size, workdir=None):
+        self.size = size
+        self.workdir = workdir or tempfile.mkdtemp(prefix='flash-model-')
+        self.snapshots_dir = os.path.join(self.workdir, 'snapshots')
+        os.makedirs(self.snapshots_dir, exist_ok=True)
+
+        self._file = None
+        self._map = None
+
+        # An erased chip is a hole of the full size
+        blank_path = self.snapshot_path('blank')
+        if not os.path.exists(blank_path):
+            with open(blank_path, 'wb') as blank_file:
+                blank_file.truncate(size)
+
+        self.restore('blank')
+
+    # ----
+    def snapshot_path(self, name):
+        return os.path.join(self.snapshots_dir, name + '.bin')
+
+    def has_snapshot(self, name):
+        return os.path.exists(self.snapshot_path(name))
+
+    def restore(self, name):
+        """
+        Makes the chip contain the given snapshot
+        """
+
+        self.close()
+
+        self._file = open(self.snapshot_path(name), 'rb')
+        self._map = mmap.mmap(self._file.fileno(), self.size, access=mmap.ACCESS_COPY)
+
+    def snapshot(self, name):
+        """
+        Saves the current contents, skipping erased pages so the file stays sparse
+        """
+
+        temp_path = self.snapshot_path(name) + '.tmp'
+        with open(temp_path, 'wb') as snapshot_file:
+            zero_page = bytes(SPARSE_PAGE)
+            for offset in range(0, self.size, SPARSE_PAGE):
+                page = self._map[offset: offset + SPARSE_PAGE]
+                if page == zero_page:
+                    snapshot_file.seek(len(page), os.SEEK_CUR)
+                else:
+                    snapshot_file.write(page)
+            snapshot_file.truncate(self.size)
+
+        os.replace(temp_path, self.snapshot_path(name))
+
+    def load_image(self, name, image_path):
+        """
+        Creates a snapshot of the chip holding image_path (padded with erased bytes)
+        """
+
+        with open(image_path, 'rb') as image_file:
+            image = image_file.read(self.size)
+
+        self.restore('blank')
+        self._map[:len(image)] = image.translate(INVERT)
+        self.snapshot(name)
+
+    def close(self):
+        if self._map is not None:
+            self._map.close()
+            self._file.close()
+            self._map = None
+
+    # ----
+    def read(self, offset, length):
+        return self._map[offset: offset + length].translate(INVERT)
+
+    def program(self, offset, data):
+        """
+        Programming can only clear bits, as on a real chip
+        """
+
+        end = offset + len(data)
+        current = int.from_bytes(self._map[offset: end], 'little')
+        cleared = int.from_bytes(data.translate(INVERT), 'little')
+        self._map[offset: end] = (current | cleared).to_bytes(len(data), 'little')
+
+    def erase(self, offset, length):
+        self._map[offset: offset + length] = bytes(length)
+
+    def erase_chip(self):
+        # Remapping the blank snapshot avoids dirtying every page of a large chip
+        self.restore('blank')
+
+# ------------
+class FlasherEmulator:
+    """
+    Speaks the SPI-Flasher firmware protocol on a pseudo-terminal, backed by a FlashModel
+
+    Passing second_target emulates an ESP32 with a chip on each SPI bus
+    """
+
+    def __init__(self, flash_model, jedec_id=DEFAULT_JEDEC_ID, second_target=None):
+        self.targets = [flash_model] + ([second_target] if second_target is not None else [])
+        self.flash = flash_model
+        self.jedec_id = jedec_id
+        self.image_cache = collections.OrderedDict()  # hash -> image, least recently used first
+        self.sector_cache = collections.OrderedDict()  # sector index -> [data, dirty], least recently used first
+        self.trace_ring = collections.deque(maxlen=TRACE_RING_SIZE)
+        self.trace_recorded = 0
+        self.erased_bytes = 0
+
+        self._master_fd = None
+        self._slave_fd = None
+        self._running = False
+        self._thread = None
+
+        self.reset_state()
+
+    # ----
+    def open_pty(self):
+        """
+        Returns the device path for the host to connect to
+        """
+
+        self._master_fd, self._slave_fd = os.openpty()
+        tty.setraw(self._slave_fd)
+
+        # Our own slave handle stays open so the host reconnecting doesn't hang the pty up
+        return os.ttyname(self._slave_fd)
+
+    def start(self):
+        self._running = True
+        self._thread = threading.Thread(target=self.serve_forever, daemon=True)
+        self._thread.start()
+
+    def stop(self):
+        self._running = False
+        if self._thread is not None:
+            self._thread.join()
+
+        os.close(self._master_fd)
+        os.close(self._slave_fd)
+
+    def serve_forever(self):
+        self._running = True
+        control = None  # The control frame being read, if any
+
+        while self._running:
+            readable, _, _ = select.select([self._master_fd], [], [], .1)
+            if not readable:
+                continue
+
+            received = os.read(self._master_fd, 65536)
+            self.stats['received'] += len(received)
+
+            for char in received:
+                # Control frames may come anywhere, even in the middle of a line, and are handled straight away
+                if control is not None or char == CONTROL_MARKER:
+                    if control is None:
+                        control = bytearray()
+                    elif char == CONTROL_MARKER:
+                        self.handle_control(bytes(control))
+                        control = None
+                    else:
+                        control.append(char)
+                    continue
+
+                if not self.frame_started:
+                    self.trace('FRAME_START', char)
+                    self.frame_started = True
+
+                if char == ord('\n'):
+                    self.handle_message(bytes(self.message))
+                    self.message.clear()
+                elif chr(char) in self.COMMANDS:
+                    self.state = chr(char)
+                else:
+                    self.message.append(char)
+
+    # ----
+    def reset_state(self):
+        self.state = None
+        self.message = bytearray()  # Dropped, as the firmware's restart drops its RX buffer
+        self.flash = self.targets[0]
+        self.streaming_targets = False
+        self.current_offset = 0
+        self.file_size = 0
+        self.data = b''
+        self.trace_enabled = False
+        self.frame_started = False
+        self.staging = None
+        self.sector_cache.clear()  # Unflushed patches are dropped, as on the device
+        self.verify_mode = VERIFY_INLINE
+        self.verify_failure = None  # First overlapped read-back that failed, reported with the next command
+        self.stats = dict.fromkeys(JOB_STATS, 0)
+
+    def send(self, line):
+        os.write(self._master_fd, line.encode('ascii') + b'\r\n')
+
+    def error(self, message):
+        self.send('!ERROR: ' + message)
+        self.reset_state()
+
+    def micros(self):
+        return int(time.perf_counter() * 1e6) & 0xFFFFFFFF
+
+    def trace(self, event, arg=0):
+        if self.trace_enabled:
+            self.trace_ring.append(struct.pack('<IHBB', self.micros(), arg & 0xFFFF, TRACE_EVENTS.index(event), 0))
+            self.trace_recorded += 1
+
+    # ----
+    def handle_message(self, message):
+        self.frame_started = False
+        self.trace('FRAME_END', len(message))
+
+        # The firmware finishes overlapped read-backs before handling the next command
+        if self.verify_failure is not None:
+            self.error(f'Verify failed in page at {self.verify_failure} : Err 0')
+            return
+
+        handler = self.COMMANDS.get(self.state)
+        if handler is not None:
+            try:
+                handler(self, message)
+            except VerifyFailed as failure:
+                self.error(f'Flash error during write in page at {failure.offset} : Err {ERRORCHKFAIL}')
+            except PreviouslyWritten as failure:
+                self.error(f'Flash error during write in page at {failure.offset} : Err {PREVWRITTEN}')
+
+    # --
+    def handle_control(self, frame):
+        """
+        Nothing runs for long here, so STATUS always finds the emulator between commands and ABORT resets at once
+        """
+
+        try:
+            command = base64.b64decode(frame)
+        except ValueError:
+            command = b''
+
+        if len(command) != 1:
+            self.send('~ERROR: Malformed control frame')
+        elif command[0] == CONTROL_STATUS:
+            state = STATE_CHARS.index(self.state) + 1 if self.state is not None else 0
+            self.send(f'~STATUS state={state} busy=0 offset={self.current_offset} erased={self.erased_bytes}/{self.flash.size}')
+        elif command[0] == CONTROL_ABORT:
+            self.send('~ABORTING')
+            self.error('Aborted')
+        else:
+            self.send('~ERROR: Unknown control command')
+
+    def payload_int(self, message):
+        return int.from_bytes(base64.b64decode(message), 'little')
+
+    def range_request(self, message, layout):
+        """
+        Range requests have fixed size payloads; any other length is reported as the firmware does
+        """
+
+        try:
+            payload = base64.b64decode(message)
+        except ValueError:
+            payload = b''
+
+        if len(payload) != struct.calcsize(layout):
+            self.error('Malformed range request')
+            return None
+
+        return struct.unpack(layout, payload)
+
+    def payload_hash(self, message):
+        return base64.b64decode(message).decode('ascii').lower()
+
+    # ----
+    def handle_set_baud(self, message):
+        # The rate itself is meaningless on a pty; report what an ESP8266's divider would produce
+        baud_rate = self.payload_int(message)
+        divider = UART_CLOCK_HZ // baud_rate if baud_rate else 0
+        if divider == 0 or baud_rate > MAX_SERIAL_BAUD_RATE:
+            self.error(f"Invalid baudrate '{baud_rate:X}'")
+            return
+
+        self.send(f'#Baud rate: {UART_CLOCK_HZ // divider} actual for {baud_rate} requested')
+        self.stats = dict.fromkeys(JOB_STATS, 0)
+
+    def handle_set_flag(self, message):
+        pass  # Erase/write preferences are not acted on by the firmware either
+
+    def handle_set_verify_mode(self, message):
+        mode = self.payload_int(message)
+        if mode > VERIFY_OVERLAPPED:
+            self.error(f'Invalid verify mode {mode}')
+            return
+
+        self.verify_mode = mode
+
+    def handle_set_file_size(self, message):
+        file_size = self.payload_int(message)
+        if file_size > self.flash.size:
+            self.error('File size exceeds flash size')
+            return
+
+        self.file_size = file_size
+
+    def handle_recv_flash_data(self, message):
+        self.trace('DECODE_START', len(message))
+        self.data = base64.b64decode(message)
+        self.trace('DECODE_END', len(self.data))
+
+        if len(self.data) == 0:
+            self.error('Data length was 0 after conversion from base64')
+            return
+
+        self.trace('CHECKSUM_START', len(self.data))
+        self.send('@' + hashlib.md5(self.data).hexdigest())
+        self.trace('CHECKSUM_END', len(self.data))
+
+    def handle_do_erase(self, message):
+        self.sector_cache.clear()
+        self.send('#Erasing chip...')
+
+        self.trace('ERASE_START')
+        self.flash.erase_chip()
+        self.erased_bytes = self.flash.size
+        self.stats['erased'] += self.flash.size
+        if self.streaming_targets:
+            return  # Reported by the next flush, as on the ESP32
+        self.trace('ERASE_END')
+
+        self.send('#Chip erased')
+
+    def handle_erase_range(self, message):
+        request = self.range_request(message, '<III')
+        if request is None:
+            return
+
+        offset, length, request_crc = request
+        if crc32(struct.pack('<II', offset, length)) != request_crc:
+            self.error('Erase range failed its CRC')
+            return
+
+        if length == 0 or offset % SECTOR_SIZE or length % SECTOR_SIZE or offset + length > self.flash.size:
+            self.error('Erase range is empty, not sector aligned or exceeds flash size')
+            return
+
+        self.sector_cache.clear()
+        self.trace('ERASE_START', offset // SECTOR_SIZE)
+        self.flash.erase(offset, length)
+        self.stats['erased'] += length
+        self.trace('ERASE_END', offset // SECTOR_SIZE)
+
+        self.send('#E_DONE')
+
+    def handle_do_flash(self, message):
+        self.sector_cache.clear()
+        self.program(self.current_offset, self.data, raw=True)  # The ESP8266's program job sends its own page programs
+        self.stage_data(self.data)
+
+        self.send('#W_OK')
+        self.trace('ACK_SENT', len(self.data))
+        self.current_offset += len(self.data)
+        self.data = b''
+
+    def handle_reset_state(self, message):
+        self.reset_state()
+
+    def handle_send_flash_info(self, message):
+        self.send(f'#JEDEC ID: 0x{self.jedec_id:X}')
+        self.send(f'#Man ID: 0x{(self.jedec_id >> 16) & 0xFF:X}')
+        self.send(f'#Memory ID: 0x{(self.jedec_id >> 8) & 0xFF:X}')
+        self.send(f'#Capacity: {self.flash.size}')
+        self.send(f'#Max Pages: {self.flash.size // PAGE_SIZE}')
+        self.send(f'#RX Buffer: {SERIAL_RX_BUFFER_SIZE}')
+        self.send('#Flow Control: none')
+        self.send('#Control: STATUS ABORT')
+        self.send('#Sector Hash: xxh64')
+        self.send('#Stats: ' + ' '.join(JOB_STATS))
+        self.send(f'#Erase Range: {SECTOR_SIZE}')
+        self.send('#Info End')
+
+    # ----
+    def read_sector(self, message):
+        sector_index = self.payload_int(message)
+        if sector_index >= self.flash.size // SECTOR_SIZE:
+            self.error(f'Sector index out of range: {sector_index}')
+            return None
+
+        return self.flash.read(sector_index * SECTOR_SIZE, SECTOR_SIZE)
+
+    def handle_send_sector_hash(self, message):
+        sector = self.read_sector(message)
+        if sector is not None:
+            self.send('@' + hashlib.md5(sector).hexdigest())
+
+    def handle_read_sector(self, message):
+        sector = self.read_sector(message)
+        if sector is not None:
+            self.send('%' + base64.b64encode(sector).decode('ascii'))
+
+    def handle_read_range(self, message):
+        request = self.range_request(message, '<IH')
+        if request is None:
+            return
+
+        offset, length = request
+        if length == 0 or length > MAX_READ_RANGE or offset + length > self.flash.size:
+            self.error('Read range is empty, too long or exceeds flash size')
+            return
+
+        data = bytearray()
+        while len(data) < length:
+            position = offset + len(data)
+            sector_data, _ = self.cache_sector(position // SECTOR_SIZE)
+            data += sector_data[position % SECTOR_SIZE: position % SECTOR_SIZE + length - len(data)]
+
+        self.send('%' + base64.b64encode(bytes(data) + struct.pack('<I', crc32(bytes(data)))).decode('ascii'))
+
+    def handle_hash_range(self, message):
+        request = self.range_request(message, '<IH')
+        if request is None:
+            return
+
+        first_sector, sector_count = request
+        if sector_count == 0 or sector_count > MAX_HASH_RANGE or first_sector + sector_count > self.flash.size // SECTOR_SIZE:
+            self.error('Hash range is empty, too long or exceeds flash size')
+            return
+
+        hashes = b''.join(struct.pack('<Q', xxh64(self.flash.read(sector_index * SECTOR_SIZE, SECTOR_SIZE)))
+                          for sector_index in range(first_sector, first_sector + sector_count))
+        self.send('%' + base64.b64encode(hashes + struct.pack('<I', crc32(hashes))).decode('ascii'))
+
+    def handle_get_stats(self, message):
+        self.send('#STATS ' + ' '.join(f'{name}={self.stats[name]}' for name in JOB_STATS))
+
+    def handle_dump_range(self, message):
+        request = self.range_request(message, '<II')
+        if request is None:
+            return
+
+        first_sector, sector_count = request
+        if first_sector + sector_count > self.flash.size // SECTOR_SIZE:
+            self.error('Dump range exceeds flash size')
+            return
+
+        range_hash = hashlib.md5()
+        for sector_index in range(first_sector, first_sector + sector_count):
+            sector = self.flash.read(sector_index * SECTOR_SIZE, SECTOR_SIZE)
+            range_hash.update(sector)
+            self.send('%' + base64.b64encode(rle_encode(sector)).decode('ascii'))
+
+        self.send('@' + range_hash.hexdigest())
+
+    def handle_sync_clock(self, message):
+        now = self.micros()
+        self.send(f'$clock,{now},{now}')
+
+    def handle_set_trace(self, message):
+        self.trace_enabled = bool(self.payload_int(message))
+        self.trace_ring.clear()
+        self.trace_recorded = 0
+
+    def handle_dump_trace(self, message):
+        self.send('%' + base64.b64encode(struct.pack('<I', self.trace_recorded) + b''.join(self.trace_ring)).decode('ascii'))
+        self.trace_ring.clear()
+        self.trace_recorded = 0
+
+    def program(self, offset, data, raw=False):
+        """
+        Raw page programs just clear bits, but SPIMemory refuses to program over bytes that aren't erased
+        """
+
+        if not raw and self.flash.read(offset, len(data)).count(0xFF) != len(data):
+            raise PreviouslyWritten(offset)
+
+        self.stats['programmed'] += len(data)
+        if data:
+            self.stats['pages'] += (offset + len(data) - 1) // PAGE_SIZE - offset // PAGE_SIZE + 1
+
+        self.trace('PROGRAM_START', len(data))
+        self.flash.program(offset, data)
+        self.trace('PROGRAM_END', len(data))
+
+        # Programming can't set bits, so data written over unerased cells reads back wrong
+        if self.verify_mode == VERIFY_OFF or self.flash.read(offset, len(data)) == data:
+            return
+
+        if self.verify_mode == VERIFY_INLINE:
+            raise VerifyFailed(offset)
+        if self.verify_failure is None:
+            self.verify_failure = offset
+
+    # ----
+    def handle_query_cache(self, message):
+        self.send('#CACHE_HIT' if self.payload_hash(message) in self.image_cache else '#CACHE_MISS')
+
+    def handle_stage_image(self, message):
+        self.staging = (self.payload_hash(message), bytearray())
+        self.send('#STAGING')
+
+    def stage_data(self, data):
+        if self.staging is None:
+            return
+
+        image_hash, staged = self.staging
+        staged += data
+        if len(staged) < self.file_size:
+            return
+
+        self.staging = None
+        if hashlib.md5(staged).hexdigest() == image_hash:
+            self.image_cache[image_hash] = bytes(staged)
+            self.image_cache.move_to_end(image_hash)
+            while len(self.image_cache) > MAX_CACHED_IMAGES:
+                self.image_cache.popitem(last=False)
+            self.send('#Image cached')
+
+    def handle_flash_from_cache(self, message):
+        image_hash = self.payload_hash(message)
+        if image_hash not in self.image_cache:
+            self.error('Image is not in the cache')
+            return
+
+        self.image_cache.move_to_end(image_hash)
+        self.sector_cache.clear()
+        image = self.image_cache[image_hash]
+        self.program(0, image)
+        self.current_offset = len(image)
+
+        self.send('#Cache flash done')
+
+    # ----
+    def handle_write_extents(self, message):
+        self.handle_extent_frame(message, patch=False)
+
+    def handle_patch_extents(self, message):
+        self.handle_extent_frame(message, patch=True)
+
+    def handle_extent_frame(self, message, patch):
+        self.trace('DECODE_START', len(message))
+        frame = base64.b64decode(message)
+        self.trace('DECODE_END', len(frame))
+
+        self.trace('CHECKSUM_START', len(frame))
+        is_intact = len(frame) >= 6 and crc32(frame[:-4]) == struct.unpack('<I', frame[-4:])[0]
+        self.trace('CHECKSUM_END', len(frame))
+
+        if not is_intact:
+            self.stats['rejected'] += len(message)
+            self.send('#X_BAD')
+            return
+
+        extent_count, = struct.unpack_from('<H', frame)
+        payload_pos = 2 + extent_count * 6
+        extents = [struct.unpack_from('<IH', frame, 2 + i * 6) for i in range(extent_count)]
+
+        if payload_pos + sum(length for _, length in extents) != len(frame) - 4 or \
+           any(offset + length > self.flash.size for offset, length in extents):
+            self.error('Extent list does not match its payload or exceeds flash size')
+            return
+
+        if not patch:
+            self.sector_cache.clear()
+
+        for offset, length in extents:
+            data = frame[payload_pos: payload_pos + length]
+            if patch:
+                self.patch_data(offset, data)
+            else:
+                self.program(offset, data)
+            payload_pos += length
+
+        self.send('#X_OK')
+        self.trace('ACK_SENT', len(frame))
+
+    # ----
+    def cache_sector(self, sector_index):
+        if sector_index in self.sector_cache:
+            self.sector_cache.move_to_end(sector_index)
+        else:
+            if len(self.sector_cache) >= SECTOR_CACHE_SLOTS:
+                self.write_back(*self.sector_cache.popitem(last=False))
+            self.sector_cache[sector_index] = [bytearray(self.flash.read(sector_index * SECTOR_SIZE, SECTOR_SIZE)), False]
+
+        return self.sector_cache[sector_index]
+
+    def patch_data(self, offset, data):
+        data_pos = 0
+        while data_pos < len(data):
+            slot = self.cache_sector((offset + data_pos) // SECTOR_SIZE)
+            sector_offset = (offset + data_pos) % SECTOR_SIZE
+            piece_length = min(len(data) - data_pos, SECTOR_SIZE - sector_offset)
+
+            slot[0][sector_offset: sector_offset + piece_length] = data[data_pos: data_pos + piece_length]
+            slot[1] = True
+            data_pos += piece_length
+
+    def write_back(self, sector_index, slot):
+        data, dirty = slot
+        if not dirty:
+            return
+
+        address = sector_index * SECTOR_SIZE
+        current = self.flash.read(address, SECTOR_SIZE)
+        if current == data:
+            self.stats['unchanged'] += 1
+            slot[1] = False
+            return
+
+        if any(old & new != new for old, new in zip(current, data)):
+            self.stats['erased'] += SECTOR_SIZE
+            self.trace('ERASE_START', sector_index)
+            self.flash.erase(address, SECTOR_SIZE)
+            self.trace('ERASE_END', sector_index)
+            current = bytes([0xFF]) * SECTOR_SIZE
+
+        # One raw program per page, from its first changed byte to its last
+        for page in range(0, SECTOR_SIZE, PAGE_SIZE):
+            changed = [i for i in range(page, page + PAGE_SIZE) if current[i] != data[i]]
+            if changed:
+                self.program(address + changed[0], bytes(data[changed[0]: changed[-1] + 1]), raw=True)
+
+        slot[1] = False
+
+    def handle_flush_sector_cache(self, message):
+        for sector_index, slot in self.sector_cache.items():
+            self.write_back(sector_index, slot)
+
+        self.send('#P_FLUSHED')
+
+    def handle_select_target(self, message):
+        index = self.payload_int(message)
+        if index >= len(self.targets):
+            self.error(f'No flash chip on target {index}')
+            return
+
+        if self.targets[index] is not self.flash:
+            for sector_index, slot in self.sector_cache.items():
+                self.write_back(sector_index, slot)
+            self.sector_cache.clear()
+            self.staging = None
+            self.current_offset = 0
+            self.flash = self.targets[index]
+
+        self.streaming_targets = True
+        self.send('#T_OK')
+
+    COMMANDS = {
+        '!': handle_set_baud,
+        '@': handle_set_flag,
+        '#': handle_set_flag,
+        '$': handle_set_file_size,
+        '%': handle_recv_flash_data,
+        '^': handle_do_erase,
+        '&': handle_do_flash,
+        '*': handle_reset_state,
+        '(': handle_send_flash_info,
+        ')': handle_send_sector_hash,
+        '[': handle_read_sector,
+        ']': handle_sync_clock,
+        ':': handle_set_trace,
+        '"': handle_dump_trace,
+        '<': handle_dump_range,
+        '>': handle_read_range,
+        '?': handle_query_cache,
+        ';': handle_stage_image,
+        "'": handle_flash_from_cache,
+        '{': handle_write_extents,
+        '}': handle_patch_extents,
+        '.': handle_flush_sector_cache,
+        '|': handle_select_target,
+        ',': handle_set_verify_mode,
+        '-': handle_hash_range,
+        '_': handle_get_stats,
+        '`': handle_erase_range
+    }
+
+# ------------
+def parse_size(text):
+    """
+    Accepts plain byte counts or K/M suffixes, e.g. 16M
+    """
+
+    multipliers = {'K': 1024, 'M': 1024 * 1024}
+    suffix = text[-1].upper()
+    if suffix in multipliers:
+        return int(text[:-1]) * multipliers[suffix]
+    return int(text)
+
+# ----
+def main():
+    """
+    Run an emulated flasher on a pseudo-terminal
+    """
+
+    parser = argparse.ArgumentParser(description='SPI-Flasher firmware emulator')
+
+    parser.add_argument('-size', nargs='?', default='16M', help='Emulated chip capacity, e.g. 16M')
+    parser.add_argument('-workdir', nargs='?', help='Directory holding the flash snapshots (default: a temp dir)')
+    parser.add_argument('-image', nargs='?', help='Start with the chip holding this image')
+    parser.add_argument('--two-targets', action='store_true', help='Emulate an ESP32 with a second chip (in -workdir/target1)')
+    parser.add_argument('-restore', nargs='?', help='Start from a snapshot saved earlier in -workdir')
+
+    args = parser.parse_args()
+
+    flash_model = FlashModel(parse_size(args.size), args.workdir)
+    if args.image is not None:
+        flash_model.load_image('image', args.image)
+        flash_model.restore('image')
+    elif args.restore is not None:
+        flash_model.restore(args.restore)
+
+    second_target = None
+    if args.two_targets:
+        second_target = FlashModel(flash_model.size, os.path.join(flash_model.workdir, 'target1'))
+
+    emulator = FlasherEmulator(flash_model, second_target=second_target)
+    print(f'Emulated flasher listening on {emulator.open_pty()}')
+    print(f'Flash snapshots are in {flash_model.snapshots_dir}')
+
+    emulator.serve_forever()
+
+# ----
+if __name__ == '__main__':
+    try:
+        main()
+    except KeyboardInterrupt:
+        print('Exiting...')
@@ -0,0 +1,227 @@
+import asyncio
+import concurrent.futures
+
+import spi_flasher
+from sector_store import SECTOR_SIZE
+from spi_flasher import write_command, handle_serial_message
+
+
+# ------------
+class FlasherSession:
+    """
+    An asyncio API for one flasher, for embedding in test frameworks and host daemons
+
+        async with FlasherSession('/dev/ttyUSB0', 921600) as session:
+            await session.erase(0x10000, 0x20000)
+            await session.write(image, 0x10000)
+            assert await session.verify(image, 0x10000)
+
+    The handshake happens once and every operation reuses the same connection. pyserial
+    blocks, so each session runs its operations in order on a thread of its own, and
+    sessions for different ports run concurrently on one event loop.
+
+    spi_flasher keeps what the firmware supports in module globals, so every session in a
+    process is assumed to talk to the same firmware build.
+
+    The device resets when it reports an error, so the session reconnects before raising it.
+    If even that fails, the session is broken and every later call raises ConnectionError.
+    """
+
+    def __init__(self, port, baud_rate=921600):
+        self.port = port
+        self.baud_rate = baud_rate
+        self.flash_info = None
+        self.capacity = None
+        self._connection = None
+        self._executor = concurrent.futures.ThreadPoolExecutor(max_workers=1, thread_name_prefix=f'flasher-{port}')
+
+    async def __aenter__(self):
+        await self.open()
+        return self
+
+    async def __aexit__(self, *exc_info):
+        await self.close()
+
+    async def _run(self, function, *args):
+        return await asyncio.get_running_loop().run_in_executor(self._executor, self._call, function, *args)
+
+    def _call(self, function, *args):
+        if self._connection is None and function != self._open:
+            raise ConnectionError(f'Session on {self.port} is not connected')
+
+        try:
+            return function(*args)
+        except ValueError:
+            raise  # Refused before anything was sent
+        except Exception:
+            if self._connection is not None and function != self._close:
+                self._reconnect()
+            raise
+
+    def _reconnect(self):
+        """
+        The device's reset on an error puts it back at its initial baud rate and drops whatever was in flight
+        """
+
+        self._connection.close()
+        self._connection = None
+
+        if spi_flasher.reinitialize_device(self.port, self.baud_rate) is False:
+            raise ConnectionError(f'Could not reconnect to device on {self.port}')
+        self._connection = spi_flasher.open_serial(self.port, self.baud_rate, timeout=5)
+
+    # ----
+    async def open(self):
+        """
+        Switches the device to baud_rate and opens the connection the session's operations share
+        Returns the flash info
+        """
+
+        await self._run(self._open)
+        return self.flash_info
+
+    def _open(self):
+        flash_info = spi_flasher.initialize_device(self.port, self.baud_rate, quiet=True)
+        if flash_info is False:
+            raise ConnectionError(f'Could not connect to device on {self.port}')
+
+        self.flash_info = flash_info
+        self.capacity = int(flash_info['Capacity'])
+        self._connection = spi_flasher.open_serial(self.port, self.baud_rate, timeout=5)
+
+    async def close(self):
+        """
+        Puts the device back in its initial state and closes the connection
+        """
+
+        if self._connection is not None:
+            await self._run(self._close)
+        self._executor.shutdown()
+
+    def _close(self):
+        try:
+            write_command(self._connection, 'DO_RESET')
+        finally:
+            self._connection.close()
+            self._connection = None
+
+    # ----
+    async def info(self):
+        """
+        Reads the flash info again, e.g. after swapping the chip
+        """
+
+        return await self._run(spi_flasher.read_flash_info, self._connection, True)
+
+    async def status(self):
+        """
+        The device's STATUS fields as a dict of strings
+        """
+
+        return await self._run(spi_flasher.query_status, self._connection)
+
+    async def stats(self):
+        """
+        The device's job accounting since the session opened, as a dict of ints
+        """
+
+        return await self._run(self._stats)
+
+    def _stats(self):
+        write_command(self._connection, 'GET_STATS')
+        reply = handle_serial_message(self._connection, mute_info=True, mandatory=True)
+        return {name: int(value) for name, value in spi_flasher.parse_fields(reply).items()}
+
+    # ----
+    async def erase(self, offset=0, length=None):
+        """
+        Erases the whole chip by default, otherwise a sector aligned range
+        """
+
+        if length is None:
+            length = self.capacity - offset
+        await self._run(self._erase, offset, length)
+
+    def _erase(self, offset, length):
+        if offset == 0 and length == self.capacity:
+            write_command(self._connection, 'DO_ERASE')
+            spi_flasher.wait_for_erase(self._connection, show_progress=False)
+        elif spi_flasher.DEVICE_ERASE_RANGE:
+            spi_flasher.erase_range(self._connection, offset, length)
+        else:
+            raise ValueError('The firmware can only erase the whole chip')
+
+    async def write(self, image, offset=0):
+        """
+        Programs image at offset; the range must already be erased
+        Returns the bytes sent again for corrupted frames
+        """
+
+        return await self._run(self._write, bytes(image), offset)
+
+    def _write(self, image, offset):
+        if offset + len(image) > self.capacity:
+            raise ValueError(f'Image at {offset:#x} runs past the end of the chip')
+
+        # Erased runs are skipped, as for a full flash
+        extents = spi_flasher.plan_extents(image)
+        pieces = ((offset + start, data) for start, data in spi_flasher.extent_pieces(image, extents))
+        retransmitted_bytes = spi_flasher.send_extent_frames(self._connection, 'WRITE_EXTENTS', pieces,
+                                                             sum(length for _, length in extents), show_progress=False)
+        spi_flasher.flush_device_sectors(self._connection)
+        return retransmitted_bytes
+
+    async def verify(self, image, offset=0):
+        """
+        Compares the chip with image at offset, by sector hash where whole sectors are covered
+        Returns True if they match
+        """
+
+        return await self._run(self._verify, bytes(image), offset)
+
+    def _verify(self, image, offset):
+        # Unaligned edges are read back and compared directly
+        head = min(-offset % SECTOR_SIZE, len(image))
+        sector_count = (len(image) - head) // SECTOR_SIZE
+        tail = head + sector_count * SECTOR_SIZE
+
+        if head and spi_flasher.read_range(self._connection, offset, head) != image[:head]:
+            return False
+
+        first_sector = (offset + head) // SECTOR_SIZE
+        sectors = range(first_sector, first_sector + sector_count)
+        for index, device_hash in zip(sectors, spi_flasher.device_sector_hashes(self._connection, sectors)):
+            start = head + (index - first_sector) * SECTOR_SIZE
+            if device_hash != spi_flasher.sector_hash_of(image[start: start + SECTOR_SIZE]):
+                return False
+
+        return tail == len(image) or spi_flasher.read_range(self._connection, offset + tail, len(image) - tail) == image[tail:]
+
+    # ----
+    async def read(self, offset, length):
+        """
+        A few bytes from anywhere on the chip
+        """
+
+        return await self._run(spi_flasher.read_range, self._connection, offset, length)
+
+    async def dump(self, offset=0, length=None):
+        """
+        A sector aligned range of the chip, the whole chip by default
+        """
+
+        if length is None:
+            length = self.capacity - offset
+        return await self._run(self._dump, offset, length)
+
+    def _dump(self, offset, length):
+        if offset % SECTOR_SIZE or length % SECTOR_SIZE:
+            raise ValueError(f'Dump range {offset:#x}:{length:#x} is not sector aligned')
+
+        first_sector, sector_count = offset // SECTOR_SIZE, length // SECTOR_SIZE
+        data = bytearray()
+        for window_start in range(first_sector, first_sector + sector_count, spi_flasher.DUMP_WINDOW_SECTORS):
+            window_sectors = min(spi_flasher.DUMP_WINDOW_SECTORS, first_sector + sector_count - window_start)
+            data += b''.join(spi_flasher.dump_sectors(self._connection, window_start, window_sectors))
+
+        return bytes(data)
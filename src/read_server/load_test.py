@@ -0,0 +1,263 @@
+import argparse
+import contextlib
+import io
+import multiprocessing
+import os
+import random
+import resource
+import statistics
+import tempfile
+import threading
+import time
+
+import spi_flasher
+from chunk_pipeline import worker_count
+from emulator import FlashModel, FlasherEmulator, parse_size
+
+
+DEFAULT_DEVICE_COUNTS = '1,4,16,50'
+DEFAULT_EMULATORS_PER_PROCESS = 4  # Emulators share a GIL too; too many per process and they become the bottleneck
+LATENCY_PERCENTILES = [50, 99, 99.9]
+
+# ------------
+class LatencyRecorder:
+    """
+    Wraps a serial connection and records the time from each write to the reply line that follows it
+
+    With several commands in flight (the extent and verify pipelines) a sample is the time from
+    the latest write, so it understates queueing on the device but still shows the host's share.
+    """
+
+    def __init__(self, connection, samples):
+        self.connection = connection
+        self.samples = samples
+        self.sent_at = None
+
+    def __getattr__(self, name):
+        return getattr(self.connection, name)
+
+    def __enter__(self):
+        self.connection.__enter__()
+        return self
+
+    def __exit__(self, *exc_info):
+        return self.connection.__exit__(*exc_info)
+
+    # ----
+    def write(self, data):
+        self.sent_at = time.perf_counter()
+        return self.connection.write(data)
+
+    def readline(self):
+        line = self.connection.readline()
+        if self.sent_at is not None and line:
+            self.samples.append(time.perf_counter() - self.sent_at)
+            self.sent_at = None
+
+        return line
+
+# ------------
+def run_emulators(count, size, pipe):
+    """
+    Hosts count emulators in this process; sends their pty paths, then serves until told to stop
+    """
+
+    emulators = [FlasherEmulator(FlashModel(size)) for _ in range(count)]
+    pipe.send([emulator.open_pty() for emulator in emulators])
+
+    for emulator in emulators:
+        emulator.start()
+
+    pipe.recv()
+    for emulator in emulators:
+        emulator.stop()
+        emulator.flash.close()
+
+@contextlib.contextmanager
+def emulated_devices(count, size, per_process):
+    """
+    Yields the pty paths of count emulated flashers, spread over worker processes
+    """
+
+    workers = []
+    ports = []
+    for first in range(0, count, per_process):
+        parent_pipe, child_pipe = multiprocessing.Pipe()
+        process = multiprocessing.Process(target=run_emulators, args=(min(per_process, count - first), size, child_pipe), daemon=True)
+        process.start()
+
+        workers.append((process, parent_pipe))
+        ports += parent_pipe.recv()
+
+    try:
+        yield ports
+    finally:
+        for process, pipe in workers:
+            pipe.send('stop')
+        for process, _ in workers:
+            process.join()
+
+# ----
+def flash_job(image_path, port, baud_rate):
+    """
+    One device's session as spi_flasher.py runs it: connect, erase, write
+    Returns (seconds, succeeded)
+    """
+
+    start_time = time.perf_counter()
+    try:
+        succeeded = spi_flasher.initialize_device(port, baud_rate) is not False and \
+                    spi_flasher.do_flash(image_path, port, baud_rate, True, True, use_cache=False) is not False
+    except Exception:
+        succeeded = False
+
+    return time.perf_counter() - start_time, succeeded
+
+def record_latencies(samples_by_port):
+    """
+    Routes spi_flasher's connections through a LatencyRecorder for their port
+    """
+
+    def open_recorded(port, baud_rate, timeout):
+        return LatencyRecorder(open_serial(port, baud_rate, timeout), samples_by_port[port])
+
+    open_serial = spi_flasher.open_serial
+    spi_flasher.open_serial = open_recorded
+    return open_serial
+
+# ----
+def run_threads(image_path, ports, baud_rate):
+    """
+    Runs every job on a thread of this process, as one host daemon would
+    Returns per-job results plus the CPU seconds and peak RSS of the whole process
+    """
+
+    samples_by_port = {port: [] for port in ports}
+    results = {}
+
+    def job(port):
+        results[port] = flash_job(image_path, port, baud_rate)
+
+    threads = [threading.Thread(target=job, args=(port,)) for port in ports]
+    cpu_start = time.process_time()
+
+    open_serial = record_latencies(samples_by_port)
+    try:
+        with contextlib.redirect_stdout(io.StringIO()):
+            for thread in threads:
+                thread.start()
+            for thread in threads:
+                thread.join()
+    finally:
+        spi_flasher.open_serial = open_serial
+
+    cpu_seconds = time.process_time() - cpu_start
+    peak_rss_kb = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    return [(*results[port], samples_by_port[port]) for port in ports], cpu_seconds, peak_rss_kb
+
+def process_job(image_path, port, baud_rate, outcomes):
+    samples = []
+
+    record_latencies({port: samples})
+    cpu_start = time.process_time()
+    with contextlib.redirect_stdout(io.StringIO()):
+        seconds, succeeded = flash_job(image_path, port, baud_rate)
+
+    outcomes.put((port, (seconds, succeeded, samples, time.process_time() - cpu_start, resource.getrusage(resource.RUSAGE_SELF).ru_maxrss)))
+
+def run_processes(image_path, ports, baud_rate):
+    """
+    Runs every job in its own process, as separate spi_flasher.py invocations would
+    """
+
+    outcome_queue = multiprocessing.Queue()
+    processes = [multiprocessing.Process(target=process_job, args=(image_path, port, baud_rate, outcome_queue)) for port in ports]
+    for process in processes:
+        process.start()
+
+    outcomes_by_port = dict(outcome_queue.get() for _ in ports)
+    for process in processes:
+        process.join()
+
+    outcomes = [outcomes_by_port[port] for port in ports]
+
+    cpu_seconds = sum(outcome[3] for outcome in outcomes)
+    peak_rss_kb = sum(outcome[4] for outcome in outcomes)
+    return [outcome[:3] for outcome in outcomes], cpu_seconds, peak_rss_kb
+
+# ------------
+def percentile(sorted_samples, percent):
+    if not sorted_samples:
+        return float('nan')
+
+    return sorted_samples[min(len(sorted_samples) - 1, int(len(sorted_samples) * percent / 100))]
+
+def report(device_count, image_size, results, cpu_seconds, peak_rss_kb, baseline):
+    """
+    Prints one row of the table; returns the median per-device throughput for later rows to compare against
+    """
+
+    throughputs = [image_size / seconds / 1e6 for seconds, succeeded, _ in results if succeeded]
+    failures = sum(1 for _, succeeded, _ in results if not succeeded)
+    latencies = sorted(sample for _, _, samples in results for sample in samples)
+
+    median = statistics.median(throughputs) if throughputs else 0
+    versus = f'{median / baseline * 100:6.0f}%' if baseline else '      -'
+    tails = ' '.join(f'{percentile(latencies, percent) * 1000:7.2f}' for percent in LATENCY_PERCENTILES)
+
+    print(f'{device_count:7d} {median:9.2f} {min(throughputs, default=0):7.2f} {versus} '
+          f'{cpu_seconds / device_count:8.2f} {tails} {peak_rss_kb / 1024:8.0f} {failures:5d}')
+    return median
+
+# ----
+def main():
+    """
+    Handle arguments and run the load test
+    """
+
+    parser = argparse.ArgumentParser(description='Drive many emulated flashers at once through the host engine')
+
+    parser.add_argument('-devices', nargs='?', default=DEFAULT_DEVICE_COUNTS, help=f'Comma separated device counts to run (default: {DEFAULT_DEVICE_COUNTS})')
+    parser.add_argument('-file', nargs='?', help='Image to flash (default: random data of -image-size)')
+    parser.add_argument('-image-size', nargs='?', default='256K', help='Size of the random image (default: 256K)')
+    parser.add_argument('-size', nargs='?', default='1M', help='Emulated chip capacity (default: 1M)')
+    parser.add_argument('-baud', nargs='?', type=int, default=921600, help='Baud rate passed to the host engine; the ptys are not paced by it')
+    parser.add_argument('-emulators-per-process', nargs='?', type=int, default=DEFAULT_EMULATORS_PER_PROCESS, help=f'Emulated devices per worker process (default: {DEFAULT_EMULATORS_PER_PROCESS})')
+    parser.add_argument('-prep-workers', nargs='?', type=worker_count, default=spi_flasher.DEFAULT_WORKERS, help='Chunk preparation workers per job (default: one per CPU)')
+    parser.add_argument('--processes', action='store_true', help='Run each job in its own process instead of a thread of one host process')
+
+    args = parser.parse_args()
+
+    spi_flasher.PREP_WORKERS = args.prep_workers
+    device_counts = [int(count) for count in args.devices.split(',')]
+
+    with tempfile.TemporaryDirectory(prefix='load-test-') as temp_dir:
+        image_path = args.file
+        if image_path is None:
+            image_path = os.path.join(temp_dir, 'image.bin')
+            with open(image_path, 'wb') as image_file:
+                image_file.write(random.Random(0).randbytes(parse_size(args.image_size)))
+        image_size = os.path.getsize(image_path)
+
+        mode = 'one process per job' if args.processes else 'threads of one host process'
+        print(f'Flashing {image_size} bytes per device, {mode}\n')
+        tail_columns = ' '.join(f'{"p" + format(percent, "g"):>7}' for percent in LATENCY_PERCENTILES)
+        print(f'{"":36} {"reply latency (ms)":^23}')
+        print(f'devices  MB/s/dev     min  vs 1st  CPU s/dev {tail_columns}  peak MB fails')
+
+        baseline = None
+        for device_count in device_counts:
+            with emulated_devices(device_count, parse_size(args.size), args.emulators_per_process) as ports:
+                run = run_processes if args.processes else run_threads
+                results, cpu_seconds, peak_rss_kb = run(image_path, ports, args.baud)
+
+            median = report(device_count, image_size, results, cpu_seconds, peak_rss_kb, baseline)
+            if baseline is None:
+                baseline = median
+
+# ----
+if __name__ == '__main__':
+    try:
+        main()
+    except KeyboardInterrupt:
+        print('Exiting...')
@@ -0,0 +1,398 @@
+import argparse
+import collections
+import errno
+import socket
+import struct
+
+from sector_store import SECTOR_SIZE
+from serial_transport import open_serial
+from spi_flasher import initialize_device, reinitialize_device, dump_sectors, send_extent_frames, flush_device_sectors, EXTENT_MIN_GAP
+
+
+DEFAULT_LISTEN = '127.0.0.1:10809'
+DEFAULT_CACHE_SECTORS = 1024  # 4MB of the chip kept on the host
+READ_AHEAD_SECTORS = 16  # Sectors fetched per DUMP_RANGE when a read misses the cache
+DIRTY_LIMIT_SECTORS = 64  # Written back without waiting for a flush once this many sectors are dirty
+MAX_REQUEST_LENGTH = 32 * 1024 * 1024
+
+# Fixed newstyle negotiation (https://github.com/NetworkBlockDevice/nbd/blob/master/doc/proto.md)
+NBD_MAGIC = 0x4E42444D41474943  # 'NBDMAGIC'
+NBD_OPTS_MAGIC = 0x49484156454F5054  # 'IHAVEOPT'
+NBD_REPLY_MAGIC = 0x0003E889045565A9
+NBD_FLAG_FIXED_NEWSTYLE = 1 << 0
+NBD_FLAG_NO_ZEROES = 1 << 1
+
+NBD_OPT_EXPORT_NAME = 1
+NBD_OPT_ABORT = 2
+NBD_OPT_LIST = 3
+NBD_OPT_INFO = 6
+NBD_OPT_GO = 7
+
+NBD_REP_ACK = 1
+NBD_REP_SERVER = 2
+NBD_REP_INFO = 3
+NBD_REP_ERR_UNSUP = 2 ** 31 + 1
+NBD_REP_ERR_INVALID = 2 ** 31 + 3
+
+NBD_INFO_EXPORT = 0
+NBD_INFO_BLOCK_SIZE = 3
+
+# Transmission
+NBD_REQUEST_MAGIC = 0x25609513
+NBD_SIMPLE_REPLY_MAGIC = 0x67446698
+NBD_FLAG_HAS_FLAGS = 1 << 0
+NBD_FLAG_READ_ONLY = 1 << 1
+NBD_FLAG_SEND_FLUSH = 1 << 2
+NBD_FLAG_SEND_FUA = 1 << 3
+NBD_CMD_FLAG_FUA = 1 << 0
+
+NBD_CMD_READ = 0
+NBD_CMD_WRITE = 1
+NBD_CMD_DISC = 2
+NBD_CMD_FLUSH = 3
+
+REQUEST_HEADER = struct.Struct('>IHHQQI')  # magic, flags, type, cookie, offset, length
+REPLY_HEADER = struct.Struct('>IIQ')  # magic, error, cookie
+OPTION_HEADER = struct.Struct('>QII')  # IHAVEOPT, option, length
+OPTION_REPLY_HEADER = struct.Struct('>QIII')  # magic, option, reply type, length
+
+# ------------
+class ChipDevice:
+    """
+    Block device view of the attached chip
+
+    Reads are served from a host-side LRU cache of sectors, filled a few sectors at a
+    time with DUMP_RANGE. Writes collect in dirty sectors and are written back on flush
+    as PATCH_EXTENTS frames holding only the bytes that changed; the device merges them
+    into its sector cache, so each touched sector is erased and programmed once however
+    many small writes it took.
+    """
+
+    def __init__(self, port, baud_rate, capacity, cache_sectors=DEFAULT_CACHE_SECTORS):
+        self.port = port
+        self.baud_rate = baud_rate
+        self.esp_connection = open_serial(port, baud_rate, timeout=5)
+        self.capacity = capacity
+        self.sector_count = capacity // SECTOR_SIZE
+        self.cache_sectors = cache_sectors
+
+        self.clean = collections.OrderedDict()  # Sector index: contents on the chip, least recently used first
+        self.dirty = {}  # Sector index: contents not yet written back
+
+    def close(self):
+        self.esp_connection.close()
+
+    def reconnect(self):
+        """
+        A device error puts the firmware back at its initial baud rate, so the link is set up again
+        """
+
+        self.esp_connection.close()
+        if reinitialize_device(self.port, self.baud_rate) is False:
+            raise ConnectionError(f'Could not reconnect to device on {self.port}')
+
+        self.esp_connection = open_serial(self.port, self.baud_rate, timeout=5)
+
+    # ----
+    def read(self, offset, length):
+        data = bytearray()
+        for index, start, end in self.sector_spans(offset, length):
+            data += self.sector(index)[start:end]
+
+        return bytes(data)
+
+    def write(self, offset, data):
+        data_pos = 0
+        for index, start, end in self.sector_spans(offset, len(data)):
+            if index not in self.dirty:
+                # A whole-sector write doesn't need the old contents until flush, and then only if cached
+                whole = start == 0 and end == SECTOR_SIZE
+                self.dirty[index] = bytearray(SECTOR_SIZE if whole else self.sector(index))
+
+            self.dirty[index][start:end] = data[data_pos: data_pos + end - start]
+            data_pos += end - start
+
+        if len(self.dirty) >= DIRTY_LIMIT_SECTORS:
+            self.flush()
+
+    def flush(self):
+        """
+        Writes every dirty sector back and waits until the device has programmed them
+        """
+
+        if not self.dirty:
+            return
+
+        pieces = []
+        for index in sorted(self.dirty):
+            pieces += self.changed_pieces(index, self.clean.get(index), self.dirty[index])
+
+        if pieces:
+            send_extent_frames(self.esp_connection, 'PATCH_EXTENTS', pieces, sum(len(data) for _, data in pieces), show_progress=False)
+            flush_device_sectors(self.esp_connection)
+
+        for index, data in self.dirty.items():
+            self.cache(index, bytes(data))
+        self.dirty.clear()
+
+    # ----
+    def sector_spans(self, offset, length):
+        """
+        Yields (sector index, start, end) for the part of each sector the range covers
+        """
+
+        end = offset + length
+        while offset < end:
+            index = offset // SECTOR_SIZE
+            start = offset % SECTOR_SIZE
+            span_end = min(SECTOR_SIZE, start + end - offset)
+
+            yield index, start, span_end
+            offset += span_end - start
+
+    def sector(self, index):
+        if index in self.dirty:
+            return self.dirty[index]
+
+        if index not in self.clean:
+            self.fetch(index)
+
+        self.clean.move_to_end(index)
+        return self.clean[index]
+
+    def fetch(self, index):
+        """
+        Reads the sector plus the uncached ones after it, as sequential reads usually continue
+        """
+
+        count = 1
+        while count < READ_AHEAD_SECTORS and index + count < self.sector_count and index + count not in self.clean:
+            count += 1
+
+        for sector_index, data in enumerate(dump_sectors(self.esp_connection, index, count), index):
+            if sector_index not in self.dirty:
+                self.cache(sector_index, data)
+
+    def cache(self, index, data):
+        self.clean[index] = data
+        self.clean.move_to_end(index)
+
+        while len(self.clean) > self.cache_sectors:
+            self.clean.popitem(last=False)
+
+    # ----
+    def changed_pieces(self, index, old, new):
+        """
+        Returns (offset, data) for the runs of new that differ from old
+        Runs closer than EXTENT_MIN_GAP are merged, as a header costs more than resending the gap
+        """
+
+        base = index * SECTOR_SIZE
+        if old is None:
+            return [(base, bytes(new))]
+
+        pieces = []
+        pos = 0
+        while pos < SECTOR_SIZE:
+            if old[pos] == new[pos]:
+                pos += 1
+                continue
+
+            start = pos
+            last_change = pos
+            while pos < SECTOR_SIZE and pos - last_change < EXTENT_MIN_GAP:
+                if old[pos] != new[pos]:
+                    last_change = pos
+                pos += 1
+
+            pieces.append((base + start, bytes(new[start: last_change + 1])))
+
+        return pieces
+
+# ------------
+class NbdServer:
+    """
+    Exports a ChipDevice over the NBD protocol, one client at a time
+    """
+
+    def __init__(self, device, read_only=False):
+        self.device = device
+        self.read_only = read_only
+
+    # ----
+    def serve_forever(self, host, port):
+        with socket.create_server((host, port)) as listener:
+            print(f'Exporting {self.device.capacity} bytes on nbd://{host}:{port}')
+
+            while True:
+                client, address = listener.accept()
+                print(f'Client connected from {address[0]}:{address[1]}')
+
+                with client:
+                    client.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+                    try:
+                        if self.negotiate(client):
+                            self.transmit(client)
+                    except (ConnectionError, EOFError):
+                        pass
+
+                print('Client disconnected')
+
+                # Don't leave writes from a client that went away without flushing in the cache
+                try:
+                    self.device.flush()
+                except Exception as error:
+                    print(f'ERROR: Write back failed, keeping the dirty sectors for the next flush: {error}')
+
+    # ----
+    def negotiate(self, client):
+        """
+        Handles the fixed newstyle handshake
+        Returns True once an export has been chosen
+        """
+
+        client.sendall(struct.pack('>QQH', NBD_MAGIC, NBD_OPTS_MAGIC, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES))
+        client_flags, = struct.unpack('>I', receive_exactly(client, 4))
+        no_zeroes = client_flags & NBD_FLAG_NO_ZEROES
+
+        while True:
+            magic, option, length = OPTION_HEADER.unpack(receive_exactly(client, OPTION_HEADER.size))
+            if magic != NBD_OPTS_MAGIC:
+                return False
+            option_data = receive_exactly(client, length)
+
+            if option == NBD_OPT_EXPORT_NAME:
+                # No way to refuse here; any name gets the chip
+                client.sendall(struct.pack('>QH', self.device.capacity, self.transmission_flags()) + (b'' if no_zeroes else bytes(124)))
+                return True
+
+            if option == NBD_OPT_ABORT:
+                send_option_reply(client, option, NBD_REP_ACK)
+                return False
+
+            if option == NBD_OPT_LIST:
+                send_option_reply(client, option, NBD_REP_SERVER, struct.pack('>I', 0))
+                send_option_reply(client, option, NBD_REP_ACK)
+
+            elif option in (NBD_OPT_INFO, NBD_OPT_GO):
+                if length < 6:
+                    send_option_reply(client, option, NBD_REP_ERR_INVALID)
+                    continue
+
+                send_option_reply(client, option, NBD_REP_INFO, struct.pack('>HQH', NBD_INFO_EXPORT, self.device.capacity, self.transmission_flags()))
+                send_option_reply(client, option, NBD_REP_INFO, struct.pack('>HIII', NBD_INFO_BLOCK_SIZE, 1, SECTOR_SIZE, MAX_REQUEST_LENGTH))
+                send_option_reply(client, option, NBD_REP_ACK)
+
+                if option == NBD_OPT_GO:
+                    return True
+
+            else:
+                send_option_reply(client, option, NBD_REP_ERR_UNSUP)
+
+    def transmission_flags(self):
+        flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA
+        return flags | NBD_FLAG_READ_ONLY if self.read_only else flags
+
+    # ----
+    def transmit(self, client):
+        while True:
+            magic, flags, command, cookie, offset, length = REQUEST_HEADER.unpack(receive_exactly(client, REQUEST_HEADER.size))
+            if magic != NBD_REQUEST_MAGIC:
+                return
+
+            # The payload has to be taken off the socket even if the write is refused
+            data = receive_exactly(client, length) if command == NBD_CMD_WRITE else None
+
+            if command == NBD_CMD_DISC:
+                return
+
+            error, reply_data = self.handle_request(command, flags, offset, length, data)
+            client.sendall(REPLY_HEADER.pack(NBD_SIMPLE_REPLY_MAGIC, error, cookie) + (reply_data or b''))
+
+    def handle_request(self, command, flags, offset, length, data):
+        """
+        Returns (errno, data to send back)
+        """
+
+        if command not in (NBD_CMD_READ, NBD_CMD_WRITE, NBD_CMD_FLUSH):
+            return errno.EINVAL, None
+
+        if command != NBD_CMD_FLUSH and (length > MAX_REQUEST_LENGTH or offset + length > self.device.capacity):
+            return errno.ENOSPC if command == NBD_CMD_WRITE else errno.EINVAL, None
+
+        if command == NBD_CMD_WRITE and self.read_only:
+            return errno.EPERM, None
+
+        try:
+            if command == NBD_CMD_READ:
+                return 0, self.device.read(offset, length)
+
+            if command == NBD_CMD_WRITE:
+                self.device.write(offset, data)
+                if flags & NBD_CMD_FLAG_FUA:
+                    self.device.flush()
+            else:
+                self.device.flush()
+
+            return 0, None
+
+        except Exception as error:
+            print(f'ERROR: {error}')
+
+            # The device reset on its error, dropping whatever was in flight. Dirty sectors stay for the next
+            # flush, and resending them is harmless as patches only ever write their final contents
+            try:
+                self.device.reconnect()
+            except Exception as reconnect_error:
+                print(f'ERROR: {reconnect_error}')  # Tried again after the next request fails
+
+            return errno.EIO, None
+
+# ----
+def receive_exactly(client, length):
+    data = bytearray()
+    while len(data) < length:
+        piece = client.recv(length - len(data))
+        if not piece:
+            raise EOFError('Client closed the connection')
+        data += piece
+
+    return bytes(data)
+
+def send_option_reply(client, option, reply_type, data=b''):
+    client.sendall(OPTION_REPLY_HEADER.pack(NBD_REPLY_MAGIC, option, reply_type, len(data)) + data)
+
+# ------------
+def main():
+    """
+    Handle arguments and run the server
+    """
+
+    parser = argparse.ArgumentParser(description='Export the chip as a network block device')
+
+    parser.add_argument('-port', nargs='?', required=True, help='The COM port to connect to')
+    parser.add_argument('-baud', nargs='?', type=int, required=True, help='Baud rate to communicate at')
+    parser.add_argument('-listen', nargs='?', default=DEFAULT_LISTEN, help=f'HOST:PORT to accept NBD clients on (default: {DEFAULT_LISTEN})')
+    parser.add_argument('-cache-sectors', nargs='?', type=int, default=DEFAULT_CACHE_SECTORS, help=f'Sectors of the chip kept on the host (default: {DEFAULT_CACHE_SECTORS})')
+    parser.add_argument('--read-only', action='store_true', help='Refuse writes')
+
+    args = parser.parse_args()
+
+    flash_info = initialize_device(args.port, args.baud)
+    if flash_info is False:
+        return
+
+    host, _, listen_port = args.listen.rpartition(':')
+    device = ChipDevice(args.port, args.baud, int(flash_info['Capacity']), args.cache_sectors)
+    try:
+        NbdServer(device, args.read_only).serve_forever(host, int(listen_port))
+    finally:
+        device.flush()
+        device.close()
+
+# ----
+if __name__ == '__main__':
+    try:
+        main()
+    except KeyboardInterrupt:
+        print('Exiting...')
@@ -0,0 +1,172 @@
+// Python bindings for the firmware's protocol core (src/SPI-Flasher/lib/protocol)
+// Built by setup.py as _flasher_protocol; protocol_codec.py falls back to pure Python without it
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <string.h>
+#include <vector>
+
+#include "protocol.h"
+
+// ----
+static PyObject * crc32(PyObject *, PyObject * args) {
+  Py_buffer data;
+  if (!PyArg_ParseTuple(args, "y*", &data)) { return nullptr; }
+
+  uint32_t crc = protocol::crc32((const uint8_t *)data.buf, data.len);
+  PyBuffer_Release(&data);
+
+  return PyLong_FromUnsignedLong(crc);
+}
+
+static PyObject * xxh64(PyObject *, PyObject * args) {
+  Py_buffer data;
+  unsigned long long seed = 0;
+  if (!PyArg_ParseTuple(args, "y*|K", &data, &seed)) { return nullptr; }
+
+  if (data.len > 0xFFFFFFFF) {
+    PyBuffer_Release(&data);
+    PyErr_SetString(PyExc_ValueError, "xxh64 takes at most 4GB at once");
+    return nullptr;
+  }
+
+  uint64_t hash = protocol::xxh64((const uint8_t *)data.buf, data.len, seed);
+  PyBuffer_Release(&data);
+
+  return PyLong_FromUnsignedLongLong(hash);
+}
+
+// --
+// command char + base64 payload + newline, built in one allocation
+static PyObject * encode_frame(PyObject *, PyObject * args) {
+  Py_buffer command, payload;
+  if (!PyArg_ParseTuple(args, "y*y*", &command, &payload)) { return nullptr; }
+
+  size_t frameLength = command.len + protocol::base64EncodedLength(payload.len) + 1;
+  PyObject * frame = PyBytes_FromStringAndSize(nullptr, frameLength);
+  if (frame != nullptr) {
+    uint8_t * out = (uint8_t *)PyBytes_AS_STRING(frame);
+    memcpy(out, command.buf, command.len);
+    size_t encodedLength = protocol::base64Encode((const uint8_t *)payload.buf, payload.len, out + command.len);
+    out[command.len + encodedLength] = '\n';
+  }
+
+  PyBuffer_Release(&command);
+  PyBuffer_Release(&payload);
+  return frame;
+}
+
+// --
+// Takes a sequence of (offset, data) pieces and returns the packed frame, CRC included
+static PyObject * build_extent_frame(PyObject *, PyObject * args) {
+  PyObject * pieces;
+  if (!PyArg_ParseTuple(args, "O", &pieces)) { return nullptr; }
+
+  PyObject * sequence = PySequence_Fast(pieces, "pieces must be a sequence");
+  if (sequence == nullptr) { return nullptr; }
+
+  Py_ssize_t count = PySequence_Fast_GET_SIZE(sequence);
+  if (count > 0xFFFF) {
+    Py_DECREF(sequence);
+    PyErr_SetString(PyExc_ValueError, "Too many extents for one frame");
+    return nullptr;
+  }
+
+  std::vector<protocol::Extent> extents(count);
+  std::vector<Py_buffer> buffers;
+  buffers.reserve(count);
+
+  PyObject * frame = nullptr;
+  uint32_t payloadLength = 0;
+  bool parsed = true;
+
+  for (Py_ssize_t i = 0; i < count && parsed; i++) {
+    unsigned long offset;
+    Py_buffer data;
+    if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(sequence, i), "ky*", &offset, &data)) {
+      parsed = false;
+      break;
+    }
+    buffers.push_back(data);
+
+    if (data.len > 0xFFFF) {
+      PyErr_SetString(PyExc_ValueError, "Extent longer than 65535 bytes");
+      parsed = false;
+      break;
+    }
+
+    extents[i] = { (uint32_t)offset, (uint16_t)data.len, (const uint8_t *)data.buf };
+    payloadLength += data.len;
+  }
+
+  if (parsed) {
+    frame = PyBytes_FromStringAndSize(nullptr, protocol::extentFrameSize(count, payloadLength));
+    if (frame != nullptr) {
+      protocol::packExtentFrame(extents.data(), count, (uint8_t *)PyBytes_AS_STRING(frame));
+    }
+  }
+
+  for (Py_buffer & buffer : buffers) { PyBuffer_Release(&buffer); }
+  Py_DECREF(sequence);
+  return frame;
+}
+
+// ----
+static PyObject * rle_encode(PyObject *, PyObject * args) {
+  Py_buffer data;
+  if (!PyArg_ParseTuple(args, "y*", &data)) { return nullptr; }
+
+  if (data.len > 0xFFFF) {
+    PyBuffer_Release(&data);
+    PyErr_SetString(PyExc_ValueError, "RLE blocks are at most 65535 bytes");
+    return nullptr;
+  }
+
+  std::vector<uint8_t> tokens;
+  tokens.reserve(data.len + protocol::RLE_TOKEN_HEADER_SIZE);
+  protocol::rleEncode((const uint8_t *)data.buf, data.len, [&](const uint8_t piece[], uint32_t length) {
+    tokens.insert(tokens.end(), piece, piece + length);
+  });
+  PyBuffer_Release(&data);
+
+  return PyBytes_FromStringAndSize((const char *)tokens.data(), tokens.size());
+}
+
+// --
+static PyObject * rle_decode(PyObject *, PyObject * args) {
+  Py_buffer tokens;
+  Py_ssize_t capacity;
+  if (!PyArg_ParseTuple(args, "y*n", &tokens, &capacity)) { return nullptr; }
+
+  if (capacity < 0) {
+    PyBuffer_Release(&tokens);
+    PyErr_SetString(PyExc_ValueError, "capacity must not be negative");
+    return nullptr;
+  }
+
+  std::vector<uint8_t> decoded(capacity);
+  int32_t decodedLength = protocol::rleDecode((const uint8_t *)tokens.buf, tokens.len, decoded.data(), capacity);
+  PyBuffer_Release(&tokens);
+
+  if (decodedLength < 0) {
+    PyErr_SetString(PyExc_ValueError, "Malformed RLE stream");
+    return nullptr;
+  }
+
+  return PyBytes_FromStringAndSize((const char *)decoded.data(), decodedLength);
+}
+
+// ----
+static PyMethodDef methods[] = {
+  { "crc32", crc32, METH_VARARGS, "CRC-32 as used by extent frames" },
+  { "xxh64", xxh64, METH_VARARGS, "xxHash64 as used by sector manifests" },
+  { "encode_frame", encode_frame, METH_VARARGS, "Command char, base64 payload and newline" },
+  { "build_extent_frame", build_extent_frame, METH_VARARGS, "Packs (offset, data) pieces into an extent frame" },
+  { "rle_encode", rle_encode, METH_VARARGS, "Dump stream tokens for a block" },
+  { "rle_decode", rle_decode, METH_VARARGS, "Expands dump stream tokens into at most capacity bytes" },
+  { nullptr, nullptr, 0, nullptr }
+};
+
+static struct PyModuleDef module = { PyModuleDef_HEAD_INIT, "_flasher_protocol", nullptr, -1, methods };
+
+PyMODINIT_FUNC PyInit__flasher_protocol() { return PyModule_Create(&module); }
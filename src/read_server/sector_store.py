@@ -0,0 +1,109 @@
+import argparse
+import json
+import os
+import time
+
+
+SECTOR_SIZE = 4096
+
+# ------------
+class SectorStore:
+    """
+    Content-addressed storage for chip backups
+
+    Each unique sector is stored once under sectors/<hash[:2]>/<hash>; a backup
+    is a manifest in manifests/ listing the hash of every sector on the chip.
+    Hashes are MD5, or xxHash64 from firmware that has HASH_RANGE; the manifest's
+    'hash' field says which (none means MD5)
+    """
+
+    def __init__(self, root):
+        self.root = root
+        self.sectors_dir = os.path.join(root, 'sectors')
+        self.manifests_dir = os.path.join(root, 'manifests')
+
+        os.makedirs(self.sectors_dir, exist_ok=True)
+        os.makedirs(self.manifests_dir, exist_ok=True)
+
+    # ----
+    def sector_path(self, sector_hash):
+        return os.path.join(self.sectors_dir, sector_hash[:2], sector_hash)
+
+    def has(self, sector_hash):
+        return os.path.exists(self.sector_path(sector_hash))
+
+    def get(self, sector_hash):
+        with open(self.sector_path(sector_hash), 'rb') as sector_file:
+            return sector_file.read()
+
+    def put(self, sector_hash, data):
+        """
+        Writes via a temp file so a crash never leaves a truncated sector behind
+        """
+
+        path = self.sector_path(sector_hash)
+        if os.path.exists(path):
+            return
+
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        temp_path = path + '.tmp'
+        with open(temp_path, 'wb') as sector_file:
+            sector_file.write(data)
+        os.replace(temp_path, path)
+
+    # ----
+    def write_manifest(self, chip_id, sector_hashes, sector_size=SECTOR_SIZE, hash_name='md5'):
+        manifest = {
+            'chip_id': chip_id,
+            'created': time.strftime('%Y-%m-%dT%H:%M:%S'),
+            'hash': hash_name,
+            'sector_size': sector_size,
+            'capacity': len(sector_hashes) * sector_size,
+            'sectors': sector_hashes
+        }
+
+        name = f'{chip_id}-{time.strftime("%Y%m%d-%H%M%S")}.json'
+        path = os.path.join(self.manifests_dir, name)
+        with open(path, 'w') as manifest_file:
+            json.dump(manifest, manifest_file, indent=1)
+
+        return path
+
+    def read_manifest(self, manifest_path):
+        with open(manifest_path, 'r') as manifest_file:
+            return json.load(manifest_file)
+
+    # ----
+    def assemble(self, manifest_path, output_file):
+        """
+        Rebuilds the full chip image described by a manifest
+        """
+
+        manifest = self.read_manifest(manifest_path)
+        with open(output_file, 'wb') as out_file:
+            for sector_hash in manifest['sectors']:
+                out_file.write(self.get(sector_hash))
+
+        return manifest['capacity']
+
+# ------------
+def main():
+    """
+    Rebuild an image from a stored backup
+    """
+
+    parser = argparse.ArgumentParser(description='Sector store utilities')
+
+    parser.add_argument('-store', nargs='?', default='backups', help='Sector store directory')
+    parser.add_argument('-manifest', nargs='?', required=True, help='Manifest of the backup to rebuild')
+    parser.add_argument('-out', nargs='?', required=True, help='File to write the rebuilt image to')
+
+    args = parser.parse_args()
+
+    store = SectorStore(args.store)
+    size = store.assemble(args.manifest, args.out)
+    print(f'Wrote {size} bytes to {args.out}')
+
+# ----
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,65 @@
+import array
+import fcntl
+import struct
+import sys
+
+import serial
+
+
+# Linux termios2 (asm-generic layout, used by x86 and ARM)
+TCGETS2 = 0x802C542A
+TCSETS2 = 0x402C542B
+BOTHER = 0o010000
+CBAUD = 0o010017
+IBSHIFT = 16
+TERMIOS2 = struct.Struct('=IIIIB19sII')  # iflag, oflag, cflag, lflag, line, cc, ispeed, ospeed
+
+RTSCTS = False  # Hardware flow control on every port opened; set from --rtscts
+
+# ------------
+def open_serial(port, baud_rate, timeout):
+    """
+    Opens the port at exactly baud_rate where the host allows it
+
+    On Linux the rate is set with BOTHER through termios2, so it need not be one of
+    the standard B* rates. The rate the driver really settled on is kept as
+    actual_baud (None where it cannot be read back).
+    """
+
+    connection = serial.Serial(port, baud_rate, timeout=timeout, rtscts=RTSCTS)
+    connection.actual_baud = None
+
+    if sys.platform.startswith('linux'):
+        try:
+            connection.actual_baud = set_exact_baud(connection.fileno(), baud_rate)
+        except OSError:
+            pass  # Not a tty that understands termios2; pyserial's setting stands
+
+    return connection
+
+# ----
+def set_exact_baud(fd, baud_rate):
+    """
+    Returns the rate read back after setting it, which drivers round to what their divider can do
+    """
+
+    buffer = array.array('B', bytes(TERMIOS2.size))
+
+    fcntl.ioctl(fd, TCGETS2, buffer, True)
+    iflag, oflag, cflag, lflag, line, cc, _, _ = TERMIOS2.unpack(buffer.tobytes())
+
+    cflag &= ~(CBAUD | (CBAUD << IBSHIFT))
+    cflag |= BOTHER | (BOTHER << IBSHIFT)
+    buffer = array.array('B', TERMIOS2.pack(iflag, oflag, cflag, lflag, line, cc, baud_rate, baud_rate))
+    fcntl.ioctl(fd, TCSETS2, buffer)
+
+    fcntl.ioctl(fd, TCGETS2, buffer, True)
+    return TERMIOS2.unpack(buffer.tobytes())[7]
+
+# ----
+def baud_error(requested, actual):
+    """
+    Fractional mismatch of actual against requested
+    """
+
+    return abs(actual - requested) / requested
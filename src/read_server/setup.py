@@ -0,0 +1,26 @@
+"""
+Builds the _flasher_protocol extension from the firmware's protocol core
+
+    python setup.py build_ext --inplace
+
+The host works without it (see protocol_codec.py), just with more per-chunk overhead
+"""
+
+import os
+
+from setuptools import setup, Extension
+
+
+PROTOCOL_DIR = os.path.join('..', 'SPI-Flasher', 'lib', 'protocol', 'src')
+
+setup(
+    name='flasher-protocol',
+    ext_modules=[
+        Extension(
+            '_flasher_protocol',
+            sources=['protocol_ext.cpp', os.path.join(PROTOCOL_DIR, 'protocol.cpp')],
+            include_dirs=[PROTOCOL_DIR],
+            extra_compile_args=['-std=c++11'] if os.name != 'nt' else []
+        )
+    ]
+)
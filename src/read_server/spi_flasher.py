@@ -1,17 +1,67 @@
 import argparse
 import base64
+import collections
+import contextlib
+import functools
 import hashlib
 import math
 import os
 import random
+import re
+import struct
 import time
 
 import serial
 
+import serial_transport
+from chunk_pipeline import prepare_in_order, worker_count, DEFAULT_WORKERS
+from protocol_codec import build_extent_frame, crc32, encode_frame, rle_decode, xxh64
+from sector_store import SectorStore, SECTOR_SIZE
+from serial_transport import open_serial, baud_error
+from timeline import Timeline
+
 
 VERBOSE_ERROR_LOGGING = False
 DATA_CHUNK_SIZE = 2048
 DEFAULT_BAUD_RATE = 9600
+RESET_SETTLE_TIME = 1.5  # The device waits a second after DO_RESET or an error before it listens at DEFAULT_BAUD_RATE again
+MAX_BAUD_ERROR = .03  # Combined host and device mismatch most UARTs still sample correctly
+CLOCK_SYNC_ROUNDS = 8
+
+EXTENT_HEADER_SIZE = 6  # offset:4, length:2
+EXTENT_MIN_GAP = 64  # Erased gaps shorter than this cost more in headers than they save
+EXTENT_MIN_PIECE = 16
+SPARSE_WRITE_THRESHOLD = .9  # Use extent frames when less than this fraction of the image needs writing
+
+DUMP_WINDOW_SECTORS = 256  # Each window is checked against the device's MD5 and re-read on mismatch
+ZERO_SECTOR = bytes(SECTOR_SIZE)
+
+# Firmware that doesn't report its RX buffer reads every buffered frame into the first command's,
+# so it gets one command at a time
+DEFAULT_RX_WINDOW = 0
+RX_WINDOW = DEFAULT_RX_WINDOW  # Bytes of unanswered commands the device can buffer; set from its flash info
+READ_RANGE_MAX = DATA_CHUNK_SIZE - 4  # The device appends a CRC32 in the same buffer
+HASH_RANGE_MAX = (DATA_CHUNK_SIZE - 4) // 8  # Sectors per HASH_RANGE; 8 byte hashes and a CRC32 in the same buffer
+DEFAULT_CRITICAL_SIZE = 0x10000  # First and last 64K: flash descriptor and boot block on most BIOS chips
+INFO_END = 'Info End'  # Last line of the flash info
+STATUS_INTERVAL = 1  # Seconds between STATUS requests while the device erases
+DEVICE_CONTROL = False  # Whether the firmware takes control frames; set from its flash info
+DEVICE_SECTOR_HASH = 'md5'  # 'xxh64' if the firmware has HASH_RANGE; set from its flash info
+DEVICE_STATS = False  # Whether the firmware keeps job accounting for GET_STATS; set from its flash info
+DEVICE_ERASE_RANGE = False  # Whether the firmware erases sector aligned ranges with ERASE_RANGE; set from its flash info
+
+# How the device reads programs back, by -verify-mode; deferred leaves it to the host's sector hashes afterwards
+DEVICE_VERIFY_MODES = {
+    'inline': 0,
+    'off': 1,
+    'deferred': 1,
+    'overlapped': 2
+}
+
+TIMELINE = None  # Set to a Timeline to record host and firmware events
+trace_records_pending = 0  # Estimated records in the firmware's trace ring since the last dump
+PREP_WORKERS = DEFAULT_WORKERS
+PREP_USE_PROCESSES = False
 
 COMMAND_CHARS = {
     'SET_BAUD': b'!',
@@ -22,45 +72,489 @@ COMMAND_CHARS = {
     'DO_ERASE': b'^',
     'DO_FLASH': b'&',
     'DO_RESET': b'*',
-    'GET_FLASH_INFO': b'('
+    'GET_FLASH_INFO': b'(',
+    'GET_SECTOR_HASH': b')',
+    'READ_SECTOR': b'[',
+    'SYNC_CLOCK': b']',
+    'SET_TRACE': b':',
+    'DUMP_TRACE': b'"',
+    'QUERY_CACHE': b'?',
+    'STAGE_IMAGE': b';',
+    'FLASH_FROM_CACHE': b"'",
+    'WRITE_EXTENTS': b'{',
+    'PATCH_EXTENTS': b'}',
+    'FLUSH_SECTOR_CACHE': b'.',
+    'DUMP_RANGE': b'<',
+    'SELECT_TARGET': b'|',
+    'READ_RANGE': b'>',
+    'SET_VERIFY_MODE': b',',
+    'HASH_RANGE': b'-',
+    'GET_STATS': b'_',
+    'ERASE_RANGE': b'`'
 }
 
+# Control frames are ~<base64 command>~; the firmware handles them as they arrive, even in the middle of a command line
+# or a long command, and answers with a '~' line
+CONTROL_MARKER = b'~'
+CONTROL_COMMANDS = {
+    'STATUS': 0,
+    'ABORT': 1
+}
+
+# Firmware trace event IDs, in order; *_START/*_END pairs become spans
+DEVICE_TRACE_EVENTS = ['FRAME_START', 'FRAME_END', 'DECODE_START', 'DECODE_END', 'CHECKSUM_START',
+                       'CHECKSUM_END', 'PROGRAM_START', 'PROGRAM_END', 'ERASE_START', 'ERASE_END',
+                       'ACK_SENT']
+TRACE_RECORD = struct.Struct('<IHBB')  # micros, arg, event, reserved
+TRACE_RING_SIZE = 256
+TRACE_RECORDS_PER_FRAME = 8  # Frame, decode and checksum spans plus the ack
+TRACE_RECORDS_PER_PROGRAM = 2
+
+PreparedChunk = collections.namedtuple('PreparedChunk', ['offset', 'length', 'data_hash', 'frame', 'pieces'])
+
 MESSAGE_TYPES = {
     '#': 'INFO',
     '!': 'ERROR',
-    '@': 'MD5'
+    '@': 'MD5',
+    '%': 'DATA',
+    '$': 'CLOCK',
+    '~': 'CONTROL'
 }
 
 # ------------
-def initialize_device(port, baud_rate):
+def initialize_device(port, baud_rate, quiet=False):
     """
     Change the ESP*'s baud rate
+    Returns the flash info reported by the chip, or False on failure
+    Only warnings and errors are printed if quiet is True
     """
 
-    print('Initiating connection...')
+    if not quiet:
+        print('Initiating connection...')
+    flash_info = {}
 
     try:
-        with serial.Serial(port, DEFAULT_BAUD_RATE, timeout=2) as esp_connection:
+        with open_serial(port, DEFAULT_BAUD_RATE, timeout=2) as esp_connection:
+            esp_connection.reset_input_buffer()  # Anything left over was sent at another rate
+
             # This will raise an exception if communicaitng with the chip fails
-            print('\nFlash info:')
-            write_command(esp_connection, 'GET_FLASH_INFO', baud_rate)
-            for _ in range(5):
-                handle_serial_message(esp_connection)
-            print()
+            if not quiet:
+                print('\nFlash info:')
+            flash_info = read_flash_info(esp_connection, mute_info=quiet)
+            if not quiet:
+                print()
 
             write_command(esp_connection, 'SET_BAUD', baud_rate)
-            handle_serial_message(esp_connection)
+            baud_reply = re.match(r'Baud rate: (\d+)', handle_serial_message(esp_connection, mute_info=True))
+
+        with open_serial(port, baud_rate, timeout=2) as esp_connection:
+            host_baud = esp_connection.actual_baud or baud_rate
 
     except serial.SerialException:
         print(f'ERROR: Could not connect to device on {port}. Check your connections.')
         return False
 
+    # Firmware from before the baud rate report, or a lost reply
+    if baud_reply is None:
+        print(f'WARNING: The device did not report its baud rate; assuming {baud_rate}')
+        device_baud = baud_rate
+    else:
+        device_baud = int(baud_reply.group(1))
+
+    # Both ends round to their own dividers; what matters is how far apart they land
+    mismatch = baud_error(host_baud, device_baud)
+    if not quiet:
+        print(f'Baud rate: host {host_baud}, device {device_baud} ({mismatch * 100:.2f}% apart)')
+    if mismatch > MAX_BAUD_ERROR:
+        print(f'WARNING: Rates are more than {MAX_BAUD_ERROR * 100:.0f}% apart; expect corrupted frames. Try a rate both ends hit closely.')
+
+    # With RTS/CTS the device holds the host off itself, so commands can be sent as fast as they are ready
+    global RX_WINDOW
+    hardware_flow_control = flash_info.get('Flow Control') == 'RTS/CTS'
+    if serial_transport.RTSCTS and not hardware_flow_control:
+        print('WARNING: The firmware was built without RTS/CTS; falling back to its RX buffer size')
+    RX_WINDOW = math.inf if serial_transport.RTSCTS and hardware_flow_control else int(flash_info.get('RX Buffer', DEFAULT_RX_WINDOW))
+
+    # Older firmware would take a control frame as part of the next command
+    global DEVICE_CONTROL, DEVICE_SECTOR_HASH, DEVICE_STATS, DEVICE_ERASE_RANGE
+    DEVICE_CONTROL = 'ABORT' in flash_info.get('Control', '').split()
+    DEVICE_SECTOR_HASH = flash_info.get('Sector Hash') or 'md5'
+    DEVICE_STATS = 'Stats' in flash_info
+    DEVICE_ERASE_RANGE = 'Erase Range' in flash_info
+
+    return flash_info
+
+def reinitialize_device(port, baud_rate):
+    """
+    Sets the baud rate again once a DO_RESET or error reply has put the device back at DEFAULT_BAUD_RATE
+    Returns the flash info, or False on failure
+    """
+
+    time.sleep(RESET_SETTLE_TIME)
+    return initialize_device(port, baud_rate, quiet=True)
+
+# ----
+def read_flash_info(esp_connection, mute_info=False):
+    """
+    Reads 'Key: value' lines up to the firmware's 'Info End'
+    Firmware from before that line is read until the link goes quiet
+    """
+
+    write_command(esp_connection, 'GET_FLASH_INFO')
+
+    flash_info = {}
+    while True:
+        line = handle_serial_message(esp_connection, mute_info=True)
+        if line in ('', INFO_END):
+            break
+
+        if not mute_info:
+            print(line)
+        key, _, value = line.partition(': ')
+        flash_info[key] = value
+
+    return flash_info
+
+# ----
+def backup_chip(port, baud_rate, store_dir, flash_info):
+    """
+    Backs the chip up into a content-addressed sector store
+    Only sectors whose hash is not already in the store are read over the link
+    """
+
+    store = SectorStore(store_dir)
+    chip_id = flash_info['JEDEC ID']
+    sector_count = int(flash_info['Capacity']) // SECTOR_SIZE
+
+    sector_hashes = []
+    sectors_read = 0
+
+    print(f'Backing up {sector_count} sectors to {store_dir}...')
+
+    with open_serial(port, baud_rate, timeout=5) as esp_connection:
+        for sector_index, sector_hash in enumerate(device_sector_hashes(esp_connection, range(sector_count))):
+            if not store.has(sector_hash):
+                # Loop until data matches up
+                while True:
+                    write_command(esp_connection, 'READ_SECTOR', sector_index)
+                    sector_data = base64.b64decode(handle_serial_message(esp_connection, mute_info=True, mandatory=True))
+
+                    if sector_hash_of(sector_data) == sector_hash:
+                        break
+                    print('Hash mismatch, retrying...')
+
+                store.put(sector_hash, sector_data)
+                sectors_read += 1
+
+            sector_hashes.append(sector_hash)
+
+    manifest_path = store.write_manifest(chip_id, sector_hashes, hash_name=DEVICE_SECTOR_HASH)
+
+    print(f'Backup complete; read {sectors_read}/{sector_count} sectors, the rest were already stored')
+    print(f'Manifest written to {manifest_path}\n')
+
+    return True
+
+# ----
+def dump_chip(port, baud_rate, out_file, flash_info):
+    """
+    Reads the whole chip into out_file
+    Windows are only written once their MD5 matches, so a retried window never leaves stale bytes
+    behind, and sectors that are entirely zero become holes in the file
+    """
+
+    capacity = int(flash_info['Capacity'])
+    sector_count = capacity // SECTOR_SIZE
+    start_time = time.time()
+
+    print(f'Dumping {capacity} bytes to {out_file}...')
+
+    with open_serial(port, baud_rate, timeout=5) as esp_connection, open(out_file, 'wb') as dump_file:
+        for first_sector in range(0, sector_count, DUMP_WINDOW_SECTORS):
+            window_sectors = min(DUMP_WINDOW_SECTORS, sector_count - first_sector)
+
+            for data in dump_sectors(esp_connection, first_sector, window_sectors):
+                if data == ZERO_SECTOR:
+                    dump_file.seek(SECTOR_SIZE, os.SEEK_CUR)
+                else:
+                    dump_file.write(data)
+
+            done = first_sector + window_sectors
+            print(f'{done * SECTOR_SIZE}/{capacity} ({round(done / sector_count * 100):d}%) dumped')
+
+        dump_file.truncate(capacity)  # Trailing holes
+
+    print(f'Dump complete in {time.time() - start_time:.1f}s\n')
+    return True
+
+# ----
+def dump_sectors(esp_connection, first_sector, sector_count):
+    """
+    Returns the contents of a run of sectors, read with DUMP_RANGE
+    The whole run is read again until its MD5 matches
+    """
+
+    while True:
+        write_command(esp_connection, 'DUMP_RANGE', struct.pack('<II', first_sector, sector_count))
+        sectors = [decode_rle_sector(base64.b64decode(handle_serial_message(esp_connection, mute_info=True, mandatory=True)))
+                   for _ in range(sector_count)]
+
+        if handle_serial_message(esp_connection, mute_info=True, mandatory=True) == hashlib.md5(b''.join(sectors)).hexdigest():
+            return sectors
+        print('Hash mismatch, retrying...')
+
+# ----
+def decode_rle_sector(sector_tokens):
+    try:
+        data = rle_decode(sector_tokens, SECTOR_SIZE)
+    except ValueError:
+        raise Exception('Received a malformed dump sector')
+
+    if len(data) != SECTOR_SIZE:
+        raise Exception(f'Dumped sector decoded to {len(data)} bytes instead of {SECTOR_SIZE}')
+
+    return data
+
+# ----
+def read_range(esp_connection, offset, length):
+    """
+    Reads a few bytes from anywhere on the chip; each piece costs one round trip, or none
+    of the device's SPI time when it is already in its sector cache
+    """
+
+    data = bytearray()
+    while len(data) < length:
+        piece_length = min(length - len(data), READ_RANGE_MAX)
+
+        # Loop until data matches up
+        while True:
+            write_command(esp_connection, 'READ_RANGE', struct.pack('<IH', offset + len(data), piece_length))
+            reply = base64.b64decode(handle_serial_message(esp_connection, mute_info=True, mandatory=True))
+
+            piece, crc = reply[:-4], reply[-4:]
+            if len(piece) == piece_length and struct.pack('<I', crc32(piece)) == crc:
+                break
+            print('Checksum mismatch, retrying...')
+
+        data += piece
+
+    return bytes(data)
+
+# ----
+def print_ranges(port, baud_rate, ranges, flash_info):
+    """
+    Hex dumps each START:LENGTH range; a negative START counts from the end of the chip
+    """
+
+    capacity = int(flash_info['Capacity'])
+
+    with open_serial(port, baud_rate, timeout=5) as esp_connection:
+        for start, length in ranges:
+            if start < 0:
+                start += capacity
+
+            data = read_range(esp_connection, start, length)
+            for line_pos in range(0, len(data), 16):
+                line = data[line_pos: line_pos + 16]
+                text = ''.join(chr(byte) if 32 <= byte < 127 else '.' for byte in line)
+                print(f'{start + line_pos:08x}  {line.hex(" "):<47}  |{text}|')
+            print()
+
+    return True
+
+# ----
+def verify_sample(port, baud_rate, rom_file, fraction, seed, critical_ranges):
+    """
+    Compares the hashes of a seeded random sample of sectors, plus every sector in
+    critical_ranges, against the image
+    Returns False on mismatch
+    """
+
+    with open(rom_file, 'rb') as file:
+        image = file.read()
+
+    sector_count = len(image) // SECTOR_SIZE  # A trailing partial sector depends on what the chip held before
+    if sector_count == 0:
+        print('Image is smaller than a sector; nothing to verify\n')
+        return True
+
+    critical = set()
+    for start, length in critical_ranges:
+        if start < 0:
+            start += sector_count * SECTOR_SIZE
+        first = max(0, start // SECTOR_SIZE)
+        last = min(sector_count, -(-(start + length) // SECTOR_SIZE))
+        critical.update(range(first, last))
+
+    others = [index for index in range(sector_count) if index not in critical]
+    sample_size = min(len(others), math.ceil(len(others) * fraction))
+    sampled = random.Random(seed).sample(others, sample_size)
+    sectors = sorted(critical) + sorted(sampled)
+
+    print(f'Verifying {len(critical)} critical and {sample_size} sampled sectors (seed {seed})...')
+    start_time = time.time()
+
+    with open_serial(port, baud_rate, timeout=5) as esp_connection:
+        mismatched = mismatched_sectors(esp_connection, image, sectors)
+
+    print(f'Checked {len(sectors)}/{sector_count} sectors in {time.time() - start_time:.1f}s')
+
+    if mismatched:
+        print(f'Verify FAILED; {len(mismatched)} sectors differ, first at {mismatched[0] * SECTOR_SIZE:#x}\n')
+        return False
+
+    # Chance that damage to k non-critical sectors slips past every sampled one
+    def miss_chance(k):
+        chance = 1
+        for i in range(k):
+            chance *= max(0, len(others) - sample_size - i) / (len(others) - i)
+        return chance
+
+    bad_sectors_for_99 = next((k for k in range(1, len(others) + 1) if miss_chance(k) <= .01), len(others))
+    print('Verify passed; critical ranges match exactly')
+    if others:
+        print(f'A single bad sector elsewhere would have been caught with {(1 - miss_chance(1)) * 100:.1f}% confidence, '
+              f'{bad_sectors_for_99} or more with 99%\n')
+
+    return True
+
+# ----
+def verify_image(esp_connection, image):
+    """
+    Checks the whole image against the chip by sector hashes, and a trailing partial sector by reading it
+    Returns False on mismatch
+    """
+
+    sector_count = len(image) // SECTOR_SIZE
+    print(f'\nVerifying {len(image)} bytes...')
+    start_time = time.time()
+
+    mismatched = mismatched_sectors(esp_connection, image, range(sector_count))
+
+    tail = image[sector_count * SECTOR_SIZE:]
+    if tail and read_range(esp_connection, sector_count * SECTOR_SIZE, len(tail)) != tail:
+        mismatched.append(sector_count)
+
+    if mismatched:
+        print(f'Verify FAILED; {len(mismatched)} sectors differ, first at {mismatched[0] * SECTOR_SIZE:#x}')
+        return False
+
+    print(f'Verify passed in {time.time() - start_time:.1f}s')
     return True
 
 # ----
-def do_flash(rom_file, port, baud_rate, do_erase, do_write):
+def mismatched_sectors(esp_connection, image, sectors):
+    """
+    Returns the sectors whose hash on the device differs from the image's
+    """
+
+    sectors = list(sectors)
+    return [index for index, device_hash in zip(sectors, device_sector_hashes(esp_connection, sectors))
+            if device_hash != sector_hash_of(image[index * SECTOR_SIZE: (index + 1) * SECTOR_SIZE])]
+
+# ----
+def sector_hash_of(data):
+    """
+    The hash the device reports for a sector holding data, as a hex string
+    """
+
+    if DEVICE_SECTOR_HASH == 'xxh64':
+        return f'{xxh64(data):016x}'
+
+    return hashlib.md5(data).hexdigest()
+
+def device_sector_hashes(esp_connection, sectors):
+    """
+    Returns the device's hash of each sector as a hex string; xxHash64 by range where the firmware has it, MD5 otherwise
+    """
+
+    sectors = list(sectors)
+    if DEVICE_SECTOR_HASH != 'xxh64':
+        return list(request_sector_hashes(esp_connection, sectors))
+
+    # Consecutive sectors go in one request, up to HASH_RANGE_MAX
+    ranges = []
+    for index in sectors:
+        if ranges and ranges[-1][0] + ranges[-1][1] == index and ranges[-1][1] < HASH_RANGE_MAX:
+            ranges[-1][1] += 1
+        else:
+            ranges.append([index, 1])
+
+    hashes = dict(zip(sectors, (f'{sector_hash:016x}' for sector_hash in request_range_hashes(esp_connection, ranges))))
+    return [hashes[index] for index in sectors]
+
+def request_range_hashes(esp_connection, ranges):
+    """
+    Returns the device's xxHash64 of every sector in the (first sector, count) ranges, in order
+    Requests are pipelined like request_sector_hashes; a reply that fails its CRC is asked for again
+    """
+
+    pending = collections.deque((first, count) for first, count in ranges)
+    awaiting = collections.deque()
+    hashes_by_range = {}
+    window = CreditWindow(RX_WINDOW)
+
+    while pending or awaiting:
+        while pending:
+            request = encode_command('HASH_RANGE', struct.pack('<IH', *pending[0]))
+            if not window.fits(len(request)):
+                break
+
+            esp_connection.write(request)
+            window.sent(len(request))
+            awaiting.append(pending.popleft())
+
+        reply = handle_serial_message(esp_connection, mute_info=True, mandatory=True)
+        window.answered()
+        first, count = awaiting.popleft()
+
+        try:
+            reply = base64.b64decode(reply)
+        except ValueError:
+            reply = b''
+
+        body, reply_crc = reply[:-4], reply[-4:]
+        if len(body) != count * 8 or crc32(body) != int.from_bytes(reply_crc, 'little'):
+            print('Hash mismatch, retrying...')
+            pending.append((first, count))
+            continue
+
+        hashes_by_range[first, count] = struct.unpack(f'<{count}Q', body)
+
+    return [sector_hash for first, count in ranges for sector_hash in hashes_by_range[first, count]]
+
+# ----
+def request_sector_hashes(esp_connection, sectors):
+    """
+    Yields the device's hash of each sector, keeping as many requests in flight as its RX buffer holds
+    """
+
+    requests = collections.deque(encode_command('GET_SECTOR_HASH', sector) for sector in sectors)
+    window = CreditWindow(RX_WINDOW)
+
+    while requests or window.in_flight:
+        while requests and window.fits(len(requests[0])):
+            esp_connection.write(requests[0])
+            window.sent(len(requests.popleft()))
+
+        reply = handle_serial_message(esp_connection, mute_info=True, mandatory=True).lower()
+        window.answered()
+        yield reply
+
+# ----
+def parse_range(range_arg):
+    """
+    Parses START:LENGTH, where either may be hex (0x...) and a negative START counts from the end of the image
+    """
+
+    start, _, length = range_arg.partition(':')
+    return int(start, 0), int(length, 0)
+
+# ----
+def do_flash(rom_file, port, baud_rate, do_erase, do_write, use_cache=True, verify_mode='inline', skip_if_current=True):
     """
     The bulk of the script logic; sends all flashing-related commands
+    With skip_if_current, a chip that already holds what the job would leave on it is left alone
     """
 
     print('Reading file...')
@@ -69,7 +563,7 @@ def do_flash(rom_file, port, baud_rate, do_erase, do_write):
         rom_data = rfile.read()
 
     rom_file_len = len(rom_data)
-    with serial.Serial(port, baud_rate, timeout=.25) as esp_connection:
+    with open_serial(port, baud_rate, timeout=.25) as esp_connection:
         print('Setting things up...')
 
         write_command(esp_connection, 'SET_ERASE', b'1' if do_erase else b'0')
@@ -84,73 +578,728 @@ def do_flash(rom_file, port, baud_rate, do_erase, do_write):
         handle_serial_message(esp_connection)
         print(f'File size set to {rom_file_len} bytes\n')
 
+        # Lasts until the DO_RESET that ends the write
+        if do_write and verify_mode != 'inline':
+            write_command(esp_connection, 'SET_VERIFY_MODE', DEVICE_VERIFY_MODES[verify_mode])
+
     # Increase the timeout now that we're sending non-trivial data
-    with serial.Serial(port, baud_rate, timeout=5) as esp_connection:
+    with open_serial(port, baud_rate, timeout=5) as esp_connection, abort_on_interrupt(esp_connection):
+        # Comparing sector hashes costs about one read of the chip, far less than an erase and write
+        if do_write and skip_if_current and DEVICE_SECTOR_HASH == 'xxh64':
+            print('Checking whether the chip already holds the image...')
+            capacity = int(read_flash_info(esp_connection, mute_info=True)['Capacity'])
+
+            if chip_matches_image(esp_connection, rom_data, capacity, do_erase):
+                print('Chip is already up to date; nothing to erase or write')
+                write_command(esp_connection, 'DO_RESET')
+                return True
+
+        if TIMELINE is not None:
+            write_command(esp_connection, 'SET_TRACE', 1)
+            sync_device_clock(esp_connection)
+
         if do_erase:
             print('Sending erase command...')
             write_command(esp_connection, 'DO_ERASE')
 
             print('Waiting on response from chip...')
-            while True:
-                msg = handle_serial_message(esp_connection, mute_info=True, unknown_ok=True)
-                if msg == 'Erasing chip...':
-                    print(msg)
-                elif msg == 'Chip erased':
-                    print(msg)
-                    break
+            with trace_span('erase'):
+                wait_for_erase(esp_connection)
 
-        # Send data
+        # Send data, unless the device already holds the image
+        blank_bytes = retransmitted_bytes = 0
         if do_write:
-            print('\nWrite in progress...')
+            image_hash = hashlib.md5(rom_data).hexdigest()
 
-            chunks_to_complete = math.ceil(rom_file_len / DATA_CHUNK_SIZE)
-            log_interval = int(round(chunks_to_complete / 100, 0))
+            extents = plan_extents(rom_data)
+            extent_bytes = sum(length for _, length in extents)
 
-            for rom_file_pos in range(0, rom_file_len, DATA_CHUNK_SIZE):
-                write_end_index = min(rom_file_pos + DATA_CHUNK_SIZE, rom_file_len)
-                data_to_write = rom_data[rom_file_pos: write_end_index]
-                data_hash = hashlib.md5(data_to_write).hexdigest()
+            if use_cache and query_image_cache(esp_connection, image_hash):
+                flash_from_cache(esp_connection, image_hash)
+            elif not use_cache or extent_bytes < rom_file_len * SPARSE_WRITE_THRESHOLD:
+                # Extent frames are pipelined and skip erased runs, but the device can't stage them into its cache
+                retransmitted_bytes = write_extents(esp_connection, rom_data, extents)
+                blank_bytes = rom_file_len - extent_bytes
+            else:
+                if use_cache:
+                    stage_image(esp_connection, image_hash)
+                retransmitted_bytes = write_image(esp_connection, rom_data)
 
-                # Loop until data matches up
-                while True:
-                    write_command(esp_connection, 'SEND_FLASH_DATA', data_to_write)
+        # An overlapped read-back of the last chunk reports its failure here
+        if do_write and verify_mode == 'overlapped':
+            flush_device_sectors(esp_connection)
 
-                    recv_hash = handle_serial_message(esp_connection, mute_info=True, mandatory=True)
-                    if recv_hash == data_hash:
-                        write_command(esp_connection, 'DO_FLASH')
+        if do_write and verify_mode == 'deferred' and not verify_image(esp_connection, rom_data):
+            write_command(esp_connection, 'DO_RESET')
+            return False
 
-                        # Wait for write to complete
-                        while True:
-                            if handle_serial_message(esp_connection, mute_info=True, unknown_ok=True) == 'W_OK':
-                                break
+        if TIMELINE is not None:
+            sync_device_clock(esp_connection)
+            dump_device_trace(esp_connection)
 
-                        break
+        if do_write:
+            if DEVICE_STATS:
+                report_job_stats(esp_connection, rom_file_len, blank_bytes, retransmitted_bytes)
+            write_command(esp_connection, 'DO_RESET')
+
+    return True
+
+# --
+def chip_matches_image(esp_connection, image, capacity, erases):
+    """
+    Whether the chip already holds what the job would leave on it: the image, and blank flash after it if the job erases
+    The first sectors are compared on their own, so a board holding something else costs one short request
+    """
+
+    if erases:
+        sector_count = capacity // SECTOR_SIZE
+        padded_image = image + b'\xff' * (-len(image) % SECTOR_SIZE)
+    else:
+        sector_count = len(image) // SECTOR_SIZE  # The partial sector's tail is whatever the chip held
+        padded_image = image
+
+    blank_hash = xxh64(b'\xff' * SECTOR_SIZE)
+    def expected_hash(index):
+        if index * SECTOR_SIZE >= len(padded_image):
+            return blank_hash
+        return xxh64(padded_image[index * SECTOR_SIZE: (index + 1) * SECTOR_SIZE])
+
+    ranges = [(first, min(HASH_RANGE_MAX, sector_count - first)) for first in range(0, sector_count, HASH_RANGE_MAX)]
+    for batch in (ranges[:1], ranges[1:]):
+        sectors = (index for first, count in batch for index in range(first, first + count))
+        if any(device_hash != expected_hash(index) for index, device_hash in zip(sectors, request_range_hashes(esp_connection, batch))):
+            return False
+
+    tail_start = sector_count * SECTOR_SIZE
+    return erases or tail_start == len(image) or read_range(esp_connection, tail_start, len(image) - tail_start) == image[tail_start:]
+
+# --
+def report_job_stats(esp_connection, image_size, blank_bytes, retransmitted_bytes):
+    """
+    Prints what the job cost next to what the image needed, from the device's counters and the host's own
+    """
+
+    write_command(esp_connection, 'GET_STATS')
+    stats = {name: int(value) for name, value in parse_fields(handle_serial_message(esp_connection, mute_info=True, mandatory=True)).items()}
+
+    def versus_image(count):
+        return f' ({count / image_size:.2f}x the image)' if image_size else ''
+
+    print('\nJob accounting:')
+    print(f'  Image              {image_size:10d} bytes')
+    print(f'  Skipped as blank   {blank_bytes:10d} bytes')
+    print(f'  Sent on the link   {stats["received"]:10d} bytes{versus_image(stats["received"])}')
+    print(f'  Retransmitted      {retransmitted_bytes:10d} bytes ({stats["rejected"]} rejected by the device)')
+    print(f'  Programmed         {stats["programmed"]:10d} bytes in {stats["pages"]} pages{versus_image(stats["programmed"])}')
+    print(f'  Erased             {stats["erased"]:10d} bytes')
+    print(f'  Sectors unchanged  {stats["unchanged"]:10d}')
+
+# --
+def erase_range(esp_connection, offset, length):
+    """
+    Erases a sector aligned range, e.g. a region about to be rewritten, without touching the rest of the chip
+    """
+
+    if offset % SECTOR_SIZE or length % SECTOR_SIZE:
+        raise ValueError(f'Erase range {offset:#x}:{length:#x} is not sector aligned')
+
+    request = struct.pack('<II', offset, length)
+    write_command(esp_connection, 'ERASE_RANGE', request + struct.pack('<I', crc32(request)))
+    while True:
+        if handle_serial_message(esp_connection, mute_info=True, unknown_ok=True) == 'E_DONE':
+            break
+
+def wait_for_erase(esp_connection, show_progress=True):
+    """
+    Waits for 'Chip erased', showing the device's progress meanwhile if it can report it
+    """
+
+    timeout = esp_connection.timeout
+    if DEVICE_CONTROL:
+        esp_connection.timeout = STATUS_INTERVAL
+
+    try:
+        while True:
+            msg = handle_serial_message(esp_connection, mute_info=True, unknown_ok=True, control_ok=True)
+            if msg == 'Erasing chip...':
+                if show_progress:
+                    print(msg)
+            elif msg == 'Chip erased':
+                if show_progress:
+                    print(f'\r{msg}          ')
+                break
+            elif msg.startswith('STATUS') and show_progress:
+                erased, _, capacity = parse_fields(msg)['erased'].partition('/')
+                if int(capacity) > 0:
+                    print(f'\rErased {int(erased) / int(capacity) * 100:.0f}%', end='', flush=True)
+            elif msg == '' and DEVICE_CONTROL:
+                send_control(esp_connection, 'STATUS')
+    finally:
+        esp_connection.timeout = timeout
+
+# ----
+def do_flash_dual(rom_files, port, baud_rate, do_erase, do_write):
+    """
+    Flashes one image to each chip of an ESP32 with a chip on both SPI buses
+    Frames for the two chips alternate, so one chip programs while the other's data is on the link
+    """
+
+    print('Reading files...')
+
+    images = []
+    for rom_file in rom_files:
+        with open(rom_file, 'rb') as rfile:
+            images.append(rfile.read())
+
+    with open_serial(port, baud_rate, timeout=5) as esp_connection, abort_on_interrupt(esp_connection):
+        for target, rom_data in enumerate(images):
+            select_target(esp_connection, target)
+            capacity = int(read_flash_info(esp_connection, mute_info=True)['Capacity'])
+            if len(rom_data) > capacity:
+                print(f'Image {rom_files[target]} is larger than the {capacity} byte chip on target {target}')
+                return False
+
+        if do_erase:
+            print('Erasing both chips...')
+            with trace_span('erase'):
+                for target in range(len(images)):
+                    select_target(esp_connection, target)
+                    write_command(esp_connection, 'DO_ERASE')
+                    handle_serial_message(esp_connection, mute_info=True, mandatory=True)  # Erasing chip...
+
+                for target in range(len(images)):
+                    wait_for_target(esp_connection, target)
+            print('Chips erased')
 
-                    else:
-                        print('Hash mismatch, retrying...')
+        if do_write:
+            start_time = time.time()
+            bytes_written = write_targets_interleaved(esp_connection, images)
+
+            for target in range(len(images)):
+                wait_for_target(esp_connection, target)
 
-                if rom_file_pos > 0 and rom_file_pos % log_interval == 0:
-                    print(f'{rom_file_pos}/{rom_file_len} ({round(((rom_file_pos / rom_file_len) * 100)):d}%) written')
-            
-            print(f'{rom_file_len}/{rom_file_len} (100%) written')  # Ensure satisfactory ending
-            print('\nWrite complete!')
+            elapsed = time.time() - start_time
+            print(f'\nWrite complete! {bytes_written} bytes to {len(images)} chips in {elapsed:.1f}s '
+                  f'({bytes_written / max(elapsed, 1e-6) / 1024:.1f} KiB/s combined)')
 
             write_command(esp_connection, 'DO_RESET')
 
     return True
 
+# ----
+def write_targets_interleaved(esp_connection, images):
+    """
+    Sends each image's extent frames, alternating between targets
+    Returns the number of bytes written across all targets
+    """
+
+    streams = []
+    bytes_to_write = 0
+    for rom_data in images:
+        extents = plan_extents(rom_data)
+        bytes_to_write += sum(length for _, length in extents)
+
+        pieces = extent_pieces(rom_data, extents)
+        prepare = functools.partial(prepare_extent_frame, 'WRITE_EXTENTS')
+        streams.append(prepare_in_order(prepare, pack_extent_frames(pieces), PREP_WORKERS, PREP_USE_PROCESSES))
+
+    print(f'\nWrite in progress ({bytes_to_write} bytes across {len(images)} chips)...')
+
+    log_interval = max(1, bytes_to_write // 100)
+    bytes_written = 0
+    selected = None
+    active = list(enumerate(streams))
+
+    while active:
+        for target, stream in list(active):
+            frame = next(stream, None)
+            if frame is None:
+                active.remove((target, stream))
+                continue
+
+            if target != selected:
+                select_target(esp_connection, target)
+                selected = target
+
+            # Loop until the frame arrives intact
+            while True:
+                with trace_span('send extents', target=target, offset=frame.offset):
+                    esp_connection.write(frame.frame)
+
+                if handle_serial_message(esp_connection, mute_info=True, mandatory=True) == 'X_OK':
+                    break
+                print('Frame corrupted in transit, retrying...')
+
+            if (bytes_written + frame.length) // log_interval != bytes_written // log_interval:
+                print(f'{bytes_written + frame.length}/{bytes_to_write} ({round((bytes_written + frame.length) / bytes_to_write * 100):d}%) written')
+            bytes_written += frame.length
+
+    return bytes_written
+
+# ----
+def wait_for_target(esp_connection, target):
+    """
+    Waits for everything queued on a target, which may include a whole-chip erase
+    """
+
+    select_target(esp_connection, target)
+    write_command(esp_connection, 'FLUSH_SECTOR_CACHE')
+    wait_for_target_reply(esp_connection, 'P_FLUSHED')
+
+def select_target(esp_connection, target):
+    """
+    Points the following commands at a target
+    Switching writes back the old target's cached sectors first, which may wait out an erase queued on it
+    """
+
+    write_command(esp_connection, 'SELECT_TARGET', target)
+    wait_for_target_reply(esp_connection, 'T_OK')
+
+def wait_for_target_reply(esp_connection, expected):
+    """
+    Waits for a reply that may be held up behind a whole-chip erase queued on the target
+    The device answers STATUS while it waits, so a STATUS that goes unanswered too means it has stopped or reset
+    """
+
+    status_sent = False
+    while True:
+        reply = handle_serial_message(esp_connection, mute_info=True, control_ok=True)
+        if reply == expected:
+            return
+
+        if reply:
+            status_sent = False
+        elif DEVICE_CONTROL and not status_sent:
+            send_control(esp_connection, 'STATUS')
+            status_sent = True
+        else:
+            raise Exception(f'Device stopped answering while waiting for {expected}')
+
+# ----
+def write_image(esp_connection, rom_data):
+    """
+    Sends the image chunk by chunk, retrying any chunk whose hash comes back wrong
+    Returns the bytes sent again for retries
+    """
+
+    rom_file_len = len(rom_data)
+
+    print('\nWrite in progress...')
+
+    chunks_to_complete = math.ceil(rom_file_len / DATA_CHUNK_SIZE)
+    log_interval = max(1, int(round(chunks_to_complete / 100, 0)))
+
+    chunk_slices = ((pos, rom_data[pos: pos + DATA_CHUNK_SIZE]) for pos in range(0, rom_file_len, DATA_CHUNK_SIZE))
+    prepared_chunks = prepare_in_order(prepare_chunk, chunk_slices, PREP_WORKERS, PREP_USE_PROCESSES)
+    retransmitted_bytes = 0
+
+    while True:
+        # Time spent here is the link waiting on host CPU
+        with trace_span('await prepared chunk'):
+            chunk = next(prepared_chunks, None)
+        if chunk is None:
+            break
+
+        rom_file_pos = chunk.offset
+        make_room_in_device_trace(esp_connection, chunk.pieces)
+
+        # Loop until data matches up
+        while True:
+            with trace_span('send chunk', offset=rom_file_pos):
+                esp_connection.write(chunk.frame)
+
+            with trace_span('await hash', offset=rom_file_pos):
+                recv_hash = handle_serial_message(esp_connection, mute_info=True, mandatory=True)
+
+            if recv_hash == chunk.data_hash:
+                write_command(esp_connection, 'DO_FLASH')
+
+                # Wait for write to complete
+                with trace_span('await W_OK', offset=rom_file_pos):
+                    while True:
+                        if handle_serial_message(esp_connection, mute_info=True, unknown_ok=True) == 'W_OK':
+                            break
+
+                break
+
+            else:
+                print('Hash mismatch, retrying...')
+                retransmitted_bytes += len(chunk.frame)
+
+        if rom_file_pos > 0 and (rom_file_pos // DATA_CHUNK_SIZE) % log_interval == 0:
+            print(f'{rom_file_pos}/{rom_file_len} ({round(((rom_file_pos / rom_file_len) * 100)):d}%) written')
+    
+    print(f'{rom_file_len}/{rom_file_len} (100%) written')  # Ensure satisfactory ending
+    print('\nWrite complete!')
+
+    return retransmitted_bytes
+
+# ----
+def prepare_chunk(chunk_slice):
+    """
+    Hashes and encodes one chunk ahead of transmission; runs in the preparation pool
+    """
+
+    offset, data = chunk_slice
+    return PreparedChunk(offset, len(data), hashlib.md5(data).hexdigest(), encode_command('SEND_FLASH_DATA', data), 1)
+
+# ----
+def plan_extents(rom_data):
+    """
+    Returns (offset, length) for every part of the image that isn't erased (0xFF)
+    Programming 0xFF never changes a flash cell, so erased runs can always be skipped
+    """
+
+    extents = []
+    for match in re.finditer(rb'[^\xff]+', rom_data):
+        start, end = match.span()
+        if extents and start - sum(extents[-1]) < EXTENT_MIN_GAP:
+            extents[-1] = (extents[-1][0], end - extents[-1][0])
+        else:
+            extents.append((start, end - start))
+
+    return extents
+
+# ----
+def extent_pieces(rom_data, extents):
+    for offset, length in extents:
+        yield offset, rom_data[offset: offset + length]
+
+# ----
+def pack_extent_frames(pieces):
+    """
+    Takes (offset, data) pieces and yields lists of them that each fit in one
+    extent frame, splitting pieces as needed
+    """
+
+    capacity = DATA_CHUNK_SIZE - 2 - 4  # count and CRC32
+    frame, used = [], 0
+
+    for offset, data in pieces:
+        data_pos = 0
+        while data_pos < len(data):
+            if capacity - used < EXTENT_HEADER_SIZE + EXTENT_MIN_PIECE:
+                yield frame
+                frame, used = [], 0
+
+            piece_length = min(len(data) - data_pos, capacity - used - EXTENT_HEADER_SIZE)
+            frame.append((offset + data_pos, data[data_pos: data_pos + piece_length]))
+            used += EXTENT_HEADER_SIZE + piece_length
+            data_pos += piece_length
+
+    if frame:
+        yield frame
+
+# ----
+def prepare_extent_frame(command, pieces):
+    """
+    Encodes one extent frame; runs in the preparation pool
+    """
+
+    body = build_extent_frame(pieces)
+    return PreparedChunk(pieces[0][0], sum(len(data) for _, data in pieces), None, encode_command(command, body), len(pieces))
+
+# ----
+def write_extents(esp_connection, rom_data, extents):
+    """
+    Sends only the populated extents of the image, batching many small ones per frame
+    Returns the bytes sent again for corrupted frames
+    """
+
+    bytes_to_write = sum(length for _, length in extents)
+    print(f'\nWrite in progress ({len(extents)} extents, {bytes_to_write} of {len(rom_data)} bytes need writing)...')
+
+    pieces = extent_pieces(rom_data, extents)
+    retransmitted_bytes = send_extent_frames(esp_connection, 'WRITE_EXTENTS', pieces, bytes_to_write)
+
+    print('\nWrite complete!')
+    return retransmitted_bytes
+
+# ----
+def send_extent_frames(esp_connection, command, pieces, bytes_to_write, show_progress=True):
+    """
+    Packs (offset, data) pieces into extent frames and sends them, resending any that arrive corrupted
+
+    Frames are kept in flight as far as the device's RX buffer allows, so the link stays busy while
+    the device programs. Each frame says where its data goes, so a corrupted one can be resent late.
+    Returns the bytes of resent frames
+    """
+
+    prepare = functools.partial(prepare_extent_frame, command)
+    prepared_frames = prepare_in_order(prepare, pack_extent_frames(pieces), PREP_WORKERS, PREP_USE_PROCESSES)
+    log_interval = max(1, bytes_to_write // 100)
+    bytes_written = 0
+    retransmitted_bytes = 0
+
+    # The trace ring is dumped between frames, which needs the link to itself
+    window = CreditWindow(RX_WINDOW if TIMELINE is None else 0)
+    to_send = collections.deque()  # Resends first
+    in_flight = collections.deque()
+
+    while True:
+        if not to_send:
+            with trace_span('await prepared chunk'):
+                frame = next(prepared_frames, None)
+            if frame is not None:
+                to_send.append(frame)
+
+        if to_send and window.fits(len(to_send[0].frame)):
+            frame = to_send.popleft()
+            make_room_in_device_trace(esp_connection, frame.pieces)
+
+            with trace_span('send extents', offset=frame.offset):
+                esp_connection.write(frame.frame)
+            window.sent(len(frame.frame))
+            in_flight.append(frame)
+            continue
+
+        if not in_flight:
+            return retransmitted_bytes
+
+        frame = in_flight.popleft()
+        with trace_span('await X_OK', offset=frame.offset):
+            reply = handle_serial_message(esp_connection, mute_info=True, mandatory=True)
+        window.answered()
+
+        if reply != 'X_OK':
+            print('Frame corrupted in transit, retrying...')
+            retransmitted_bytes += len(frame.frame)
+            to_send.appendleft(frame)
+            continue
+
+        if show_progress and (bytes_written + frame.length) // log_interval != bytes_written // log_interval:
+            print(f'{bytes_written + frame.length}/{bytes_to_write} ({round((bytes_written + frame.length) / bytes_to_write * 100):d}%) written')
+        bytes_written += frame.length
+
+# ----
+class CreditWindow:
+    """
+    Bytes of sent commands the device hasn't answered yet, which may all still be in its RX buffer
+
+    Every command counted here gets exactly one reply, and the device only takes a command
+    out of the buffer after replying to the one before, so a command may be sent whenever
+    it fits alongside the unanswered ones. One is always allowed, however large.
+    """
+
+    def __init__(self, capacity):
+        self.capacity = capacity
+        self.in_flight = collections.deque()
+        self.used = 0
+
+    def fits(self, length):
+        return not self.in_flight or self.used + length <= self.capacity
+
+    def sent(self, length):
+        self.in_flight.append(length)
+        self.used += length
+
+    def answered(self):
+        self.used -= self.in_flight.popleft()
+
+# ----
+def patch_chip(port, baud_rate, patches, flash_info):
+    """
+    Writes small (offset, data) patches in place without touching the rest of the chip
+    The device merges them into cached sectors and erases each affected sector at most once
+    """
+
+    capacity = int(flash_info['Capacity'])
+    for offset, data in patches:
+        if offset + len(data) > capacity:
+            raise Exception(f'Patch at {offset:#x} runs past the end of the chip')
+
+    bytes_to_write = sum(len(data) for _, data in patches)
+    print(f'\nPatching {len(patches)} ranges ({bytes_to_write} bytes)...')
+
+    with open_serial(port, baud_rate, timeout=5) as esp_connection:
+        retransmitted_bytes = send_extent_frames(esp_connection, 'PATCH_EXTENTS', patches, bytes_to_write)
+        flush_device_sectors(esp_connection)
+
+        if DEVICE_STATS:
+            report_job_stats(esp_connection, bytes_to_write, 0, retransmitted_bytes)
+
+    print('Patch complete!')
+    return True
+
+# ----
+def flush_device_sectors(esp_connection):
+    """
+    Waits until the device has written back every patched sector
+    """
+
+    write_command(esp_connection, 'FLUSH_SECTOR_CACHE')
+    while True:
+        if handle_serial_message(esp_connection, mute_info=True, unknown_ok=True) == 'P_FLUSHED':
+            break
+
+# ----
+def parse_patch(patch_arg):
+    """
+    Parses OFFSET:FILE, where OFFSET may be hex (0x...)
+    """
+
+    offset, _, patch_file = patch_arg.partition(':')
+    with open(patch_file, 'rb') as pfile:
+        return int(offset, 0), pfile.read()
+
+# ----
+def query_image_cache(esp_connection, image_hash):
+    write_command(esp_connection, 'QUERY_CACHE', image_hash)
+    return handle_serial_message(esp_connection, mute_info=True, mandatory=True) == 'CACHE_HIT'
+
+# ----
+def stage_image(esp_connection, image_hash):
+    """
+    Asks the device to keep a copy of the image as it is written
+    """
+
+    write_command(esp_connection, 'STAGE_IMAGE', image_hash)
+    if handle_serial_message(esp_connection, mute_info=True, mandatory=True) != 'STAGING':
+        print('Image will not be cached on the device (not enough space)')
+
+# ----
+def flash_from_cache(esp_connection, image_hash):
+    """
+    Programs the chip from the device's own copy of the image; nothing is sent over the link
+    """
+
+    print('\nImage is cached on the device, programming from the local copy...')
+    write_command(esp_connection, 'FLASH_FROM_CACHE', image_hash)
+
+    with trace_span('flash from cache'):
+        while True:
+            if handle_serial_message(esp_connection, mute_info=True, unknown_ok=True) == 'Cache flash done':
+                break
+
+    print('\nWrite complete!')
+
+# ------------
+# Tracing
+
+def trace_span(name, **args):
+    return contextlib.nullcontext() if TIMELINE is None else TIMELINE.span(name, **args)
+
+# ----
+def make_room_in_device_trace(esp_connection, pieces):
+    """
+    Dumps the firmware's trace ring before the next frame (programming this many pieces) could overflow it
+    """
+
+    global trace_records_pending
+    if TIMELINE is None:
+        return
+
+    expected_records = TRACE_RECORDS_PER_FRAME + TRACE_RECORDS_PER_PROGRAM * pieces
+    # Leave headroom for records from commands the estimate doesn't cover (clock syncs, erases)
+    if trace_records_pending + expected_records > TRACE_RING_SIZE * 3 // 4:
+        dump_device_trace(esp_connection)
+    trace_records_pending += expected_records
+
+# ----
+def dump_device_trace(esp_connection):
+    """
+    Pulls (and empties) the firmware's trace ring and adds its events to the timeline
+    """
+
+    global trace_records_pending
+    trace_records_pending = 0
+
+    write_command(esp_connection, 'DUMP_TRACE')
+    dump = base64.b64decode(handle_serial_message(esp_connection, mute_info=True, mandatory=True))
+
+    recorded, = struct.unpack_from('<I', dump)
+    records = list(TRACE_RECORD.iter_unpack(dump[4:]))
+    if recorded > len(records):
+        print(f'Firmware trace ring overflowed; {recorded - len(records)} events were lost')
+
+    open_spans = {}
+    for device_us, arg, event_id, _ in records:
+        event = DEVICE_TRACE_EVENTS[event_id]
+        kind, _, edge = event.rpartition('_')
+        name = kind.lower()
+
+        if edge == 'START':
+            open_spans[name] = device_us
+        elif edge == 'END' and name in open_spans:
+            TIMELINE.add_device_span(name, open_spans.pop(name), device_us, arg=arg)
+        else:
+            TIMELINE.add_device_instant(event.lower(), device_us, arg=arg)
+
+# ----
+def sync_device_clock(esp_connection):
+    """
+    Samples the device clock a few times so its events can be placed on the host clock
+    """
+
+    samples = []
+    for _ in range(CLOCK_SYNC_ROUNDS):
+        host_send_us = TIMELINE.now_us()
+        write_command(esp_connection, 'SYNC_CLOCK')
+        reply = handle_serial_message(esp_connection, mute_info=True, mandatory=True)
+        host_recv_us = TIMELINE.now_us()
+
+        samples.append((host_send_us, int(reply.split(',')[1]), host_recv_us))
+
+    TIMELINE.add_clock_samples(samples)
+
+# ----
+def send_control(esp_connection, command):
+    """
+    Sends a control frame; safe to call from another thread while a command line is being written
+    """
+
+    esp_connection.write(CONTROL_MARKER + base64.b64encode(bytes([CONTROL_COMMANDS[command]])) + CONTROL_MARKER)
+
+def query_status(esp_connection):
+    """
+    Asks the device what it is doing; for when nothing else is reading replies, e.g. while it works through a long command
+    Returns the STATUS fields as a dict of strings
+    """
+
+    send_control(esp_connection, 'STATUS')
+    while True:
+        reply = handle_serial_message(esp_connection, mute_info=True, mandatory=True, control_ok=True)
+        if reply.startswith('STATUS'):
+            return parse_fields(reply)
+
+def parse_fields(reply):
+    """
+    'NAME key=value ...' replies, e.g. STATUS and STATS, as a dict of strings
+    """
+
+    return dict(field.split('=', 1) for field in reply.split()[1:])
+
+@contextlib.contextmanager
+def abort_on_interrupt(esp_connection):
+    """
+    On Ctrl+C, tells the device to drop what it is doing (an erase can take minutes) and go back to its initial state
+    """
+
+    try:
+        yield
+    except KeyboardInterrupt:
+        if DEVICE_CONTROL:
+            send_control(esp_connection, 'ABORT')
+            print('\nAborted the device\'s current command')
+        raise
+
 # ------------
 # Helper methods
 
-def handle_serial_message(serial_connection, mute_info=False, mandatory=False, unknown_ok=False):
+def handle_serial_message(serial_connection, mute_info=False, mandatory=False, unknown_ok=False, control_ok=False):
     """
     Echoes INFO messages if mute_info is not True
     Raises exception on errors and unknown message types
-    Returns message data for MD5 and INFO
+    Returns message data for MD5, DATA, CLOCK and INFO, and for CONTROL if control_ok is True
     """
 
-    data = serial_connection.readline()
-    output = data.decode('ascii').strip()
+    # Control replies can come between any two lines; they are skipped unless the caller is waiting for one
+    while True:
+        data = serial_connection.readline()
+        output = data.decode('ascii').strip()
+
+        if control_ok or output[:1] != '~':
+            break
 
     if len(output) == 0:
         if mandatory:
@@ -176,7 +1325,7 @@ def handle_serial_message(serial_connection, mute_info=False, mandatory=False, u
         if not mute_info:
             print(message_data)
 
-    elif message_type == 'MD5':
+    elif message_type in ('MD5', 'DATA', 'CLOCK', 'CONTROL'):
         pass  # just return data
 
     return message_data
@@ -188,13 +1337,20 @@ def write_command(serial_connection, command, data=None):
     and the overall message to the correct format.
     """
 
+    serial_connection.write(encode_command(command, data))
+
+# ----
+def encode_command(command, data=None):
+    """
+    Builds the bytes of a command message without sending it
+    """
+
     if type(data) is int:
         data = data.to_bytes(4, 'little')  # unsigned 32-bit int
     elif type(data) is not bytes:
         data = str(data).encode('ascii')
 
-    data = b'' if data is None else base64.b64encode(data)
-    serial_connection.write(COMMAND_CHARS[command] + data + b'\n')
+    return encode_frame(COMMAND_CHARS[command], b'' if data is None else data)
 
 # ------------
 def main():
@@ -204,21 +1360,48 @@ def main():
 
     parser = argparse.ArgumentParser(description='Basic ROM Flasher')
 
-    parser.add_argument('-file', nargs='?', required=True, help='The file to flash to the ROM')
+    parser.add_argument('-file', nargs='?', help='The file to flash to the ROM')
+    parser.add_argument('-file2', nargs='?', help='Image for a second chip on an ESP32 (HSPI bus); both chips are flashed at once')
     parser.add_argument('-port', nargs='?', required=True, help='The COM port to connect to')
-    parser.add_argument('-baud', nargs='?', type=int, required=True, help='Baud rate to communicate at; try a high value like: 921600, 700000, 576000, 250000, 115200')
+    parser.add_argument('-baud', nargs='?', type=int, required=True, help='Baud rate to communicate at; try a high value like: 2000000, 1500000, 921600, 576000, 115200')
+    parser.add_argument('--rtscts', action='store_true', help='Use hardware flow control (ESP32 firmware built with FLASHER_UART_RTS_PIN/CTS_PIN)')
     parser.add_argument('--erase', action='store_true', help='Erase the chip')
     parser.add_argument('--write', action='store_true', help='Write to the chip')
+    parser.add_argument('--backup', action='store_true', help='Back the chip up before erasing or writing')
+    parser.add_argument('-store', nargs='?', default='backups', help='Directory of the sector store used by --backup')
+    parser.add_argument('-dump', nargs='?', help='Read the whole chip into this file')
+    parser.add_argument('-read', action='append', default=[], help='START:LENGTH to hex dump from the chip; may be repeated, and a negative START (given as -read=-0x1000:64) counts from the end')
+    parser.add_argument('-patch', action='append', default=[], help='OFFSET:FILE to write in place without reflashing; may be repeated')
+    parser.add_argument('--no-cache', action='store_true', help='Do not use or fill the image cache on the device')
+    parser.add_argument('--force', action='store_true', help='Erase and write even if the chip already holds the image')
+    parser.add_argument('-verify-mode', nargs='?', choices=list(DEVICE_VERIFY_MODES), default='inline',
+                        help='How writes are read back: inline before each ack (default), off, deferred to sector hashes after the write, or overlapped with the next chunk')
+    parser.add_argument('-prep-workers', nargs='?', type=worker_count, default=DEFAULT_WORKERS, help='Workers preparing chunks ahead of the link (default: one per CPU)')
+    parser.add_argument('--prep-processes', action='store_true', help='Prepare chunks in worker processes instead of threads')
+    parser.add_argument('-verify-sample', nargs='?', type=float, help='Verify this fraction of sectors (e.g. 0.05) plus the critical ranges against -file')
+    parser.add_argument('-verify-seed', nargs='?', type=int, help='Seed choosing the sampled sectors (default: random, and printed)')
+    parser.add_argument('-critical', action='append', default=[], help='START:LENGTH always verified in full; may be repeated, and a negative START (given as -critical=-0x10000:0x10000) counts from the end (default: first and last 64K)')
+    parser.add_argument('-trace', nargs='?', help='Write a Chrome trace of host and firmware events to this file')
 
     args = parser.parse_args()
 
-    if not os.path.exists(args.file):
+    global TIMELINE, PREP_WORKERS, PREP_USE_PROCESSES
+    if args.trace is not None:
+        TIMELINE = Timeline()
+
+    PREP_WORKERS = args.prep_workers
+    PREP_USE_PROCESSES = args.prep_processes
+    serial_transport.RTSCTS = args.rtscts
+
+    do_flash_job = args.erase or args.write
+    if (do_flash_job or args.verify_sample is not None) and (args.file is None or not os.path.exists(args.file)):
         print('Provided file does not exist\nFlash failed')
         return
 
     for attempt in range(2):
         try:
-            if initialize_device(args.port, args.baud) is False:
+            flash_info = initialize_device(args.port, args.baud)
+            if flash_info is False:
                 print('Flash failed')
                 return
             break
@@ -230,9 +1413,57 @@ def main():
                 return
             time.sleep(.5)
 
-    flash_status_code = do_flash(args.file, args.port, args.baud, args.erase, args.write)
-    if flash_status_code is False:
-        print('Flash failed')
+    if args.backup and backup_chip(args.port, args.baud, args.store, flash_info) is False:
+        print('Backup failed')
+        return
+
+    if args.read and print_ranges(args.port, args.baud, [parse_range(read) for read in args.read], flash_info) is False:
+        print('Read failed')
+        return
+
+    if args.dump is not None and dump_chip(args.port, args.baud, args.dump, flash_info) is False:
+        print('Dump failed')
+        return
+
+    if do_flash_job and args.file2 is not None:
+        if not os.path.exists(args.file2) or do_flash_dual([args.file, args.file2], args.port, args.baud, args.erase, args.write) is False:
+            print('Flash failed')
+            return
+
+    elif do_flash_job:
+        flash_status_code = do_flash(args.file, args.port, args.baud, args.erase, args.write, not args.no_cache, args.verify_mode, not args.force)
+        if flash_status_code is False:
+            print('Flash failed')
+            return
+
+    # Flash jobs end with DO_RESET, which leaves the device at DEFAULT_BAUD_RATE
+    device_reset = do_flash_job
+
+    if args.patch and device_reset:
+        flash_info = reinitialize_device(args.port, args.baud)
+        if flash_info is False:
+            print('Patch failed')
+            return
+        device_reset = False
+
+    if args.patch and patch_chip(args.port, args.baud, [parse_patch(patch) for patch in args.patch], flash_info) is False:
+        print('Patch failed')
+
+    if args.verify_sample is not None:
+        if device_reset and reinitialize_device(args.port, args.baud) is False:
+            print('Verify failed')
+            return
+
+        seed = args.verify_seed if args.verify_seed is not None else random.randrange(2 ** 32)
+        critical_ranges = [parse_range(critical) for critical in args.critical] or \
+                          [(0, DEFAULT_CRITICAL_SIZE), (-DEFAULT_CRITICAL_SIZE, DEFAULT_CRITICAL_SIZE)]
+
+        if verify_sample(args.port, args.baud, args.file, args.verify_sample, seed, critical_ranges) is False:
+            print('Verify failed')
+
+    if TIMELINE is not None:
+        event_count = TIMELINE.export(args.trace)
+        print(f'Wrote {event_count} trace events to {args.trace}')
 
 # ----
 if __name__ == '__main__':
@@ -0,0 +1,119 @@
+import contextlib
+import json
+import time
+
+
+DEVICE_CLOCK_WRAP = 2 ** 32  # The ESP* reports micros() as an unsigned 32-bit value
+
+HOST_PID = 1
+DEVICE_PID = 2
+
+# ------------
+class Timeline:
+    """
+    Collects host and firmware events and exports them on the host's clock in
+    Chrome trace format (open in chrome://tracing or ui.perfetto.dev)
+
+    The device clock is mapped onto the host clock from round-trip samples taken
+    with add_clock_sample(); with samples from the start and end of a session the
+    drift between the two crystals is corrected as well
+    """
+
+    def __init__(self):
+        self.origin = time.perf_counter()
+        self.host_events = []
+        self.device_events = []
+        self.clock_syncs = []  # (host_us, offset_us) pairs, one per sync round
+
+        self._last_device_us = None
+        self._device_wraps = 0
+
+    # ----
+    def now_us(self):
+        return (time.perf_counter() - self.origin) * 1e6
+
+    @contextlib.contextmanager
+    def span(self, name, **args):
+        begin = self.now_us()
+        try:
+            yield
+        finally:
+            self.host_events.append((name, begin, self.now_us(), args))
+
+    # ----
+    def unwrap_device_us(self, device_us):
+        """
+        Extends the device's 32-bit timestamps, which wrap every ~71 minutes
+        """
+
+        if self._last_device_us is not None:
+            delta = device_us - self._last_device_us
+            if delta < -(DEVICE_CLOCK_WRAP // 2):
+                self._device_wraps += 1
+            elif delta > DEVICE_CLOCK_WRAP // 2:
+                # Late event from just before the last wrap
+                return device_us + (self._device_wraps - 1) * DEVICE_CLOCK_WRAP
+
+        self._last_device_us = device_us
+        return device_us + self._device_wraps * DEVICE_CLOCK_WRAP
+
+    def add_device_span(self, name, begin_us, end_us, **args):
+        self.device_events.append((name, self.unwrap_device_us(begin_us), self.unwrap_device_us(end_us), args))
+
+    def add_device_instant(self, name, device_us, **args):
+        self.device_events.append((name, self.unwrap_device_us(device_us), None, args))
+
+    # ----
+    def add_clock_samples(self, samples):
+        """
+        Takes (host_send_us, device_us, host_recv_us) samples from one sync round
+        The sample with the shortest round trip has the least queuing error
+        """
+
+        host_send, device_us, host_recv = min(samples, key=lambda sample: sample[2] - sample[0])
+        host_mid = (host_send + host_recv) / 2
+
+        self.clock_syncs.append((host_mid, self.unwrap_device_us(device_us) - host_mid))
+
+    def device_to_host_us(self, device_us):
+        if not self.clock_syncs:
+            raise Exception('No clock sync samples; cannot place device events on the host clock')
+
+        first_host, first_offset = self.clock_syncs[0]
+        last_host, last_offset = self.clock_syncs[-1]
+
+        drift = 0
+        if last_host > first_host:
+            drift = (last_offset - first_offset) / (last_host - first_host)
+
+        approx_host = device_us - first_offset
+        return approx_host - drift * (approx_host - first_host)
+
+    # ----
+    def export(self, path):
+        """
+        Writes all events as Chrome trace JSON
+        """
+
+        events = [
+            {'name': 'process_name', 'ph': 'M', 'pid': HOST_PID, 'args': {'name': 'Host'}},
+            {'name': 'process_name', 'ph': 'M', 'pid': DEVICE_PID, 'args': {'name': 'Firmware'}}
+        ]
+
+        for name, begin, end, args in self.host_events:
+            events.append({'name': name, 'ph': 'X', 'pid': HOST_PID, 'tid': 1,
+                           'ts': begin, 'dur': end - begin, 'args': args})
+
+        for name, begin, end, args in self.device_events:
+            host_begin = self.device_to_host_us(begin)
+            if end is None:
+                events.append({'name': name, 'ph': 'i', 's': 't', 'pid': DEVICE_PID, 'tid': 1,
+                               'ts': host_begin, 'args': args})
+            else:
+                events.append({'name': name, 'ph': 'X', 'pid': DEVICE_PID, 'tid': 1,
+                               'ts': host_begin, 'dur': self.device_to_host_us(end) - host_begin, 'args': args})
+
+        with open(path, 'w') as trace_file:
+            json.dump({'traceEvents': events, 'displayTimeUnit': 'ms'}, trace_file)
+
+        return len(events)